@@ -0,0 +1,133 @@
+/*
+  Copyright ©2013 The Regents of the University of California
+  (Regents). All Rights Reserved. Permission to use, copy, modify, and
+  distribute this software and its documentation for educational,
+  research, and not-for-profit purposes, without fee and without a
+  signed licensing agreement, is hereby granted, provided that the
+  above copyright notice, this paragraph and the following two
+  paragraphs appear in all copies, modifications, and
+  distributions. Contact The Office of Technology Licensing, UC
+  Berkeley, 2150 Shattuck Avenue, Suite 510, Berkeley, CA 94720-1620,
+  (510) 643-7201, for commercial licensing opportunities.
+
+  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT,
+  INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+  LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS
+  DOCUMENTATION, EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY
+  OF SUCH DAMAGE.
+
+  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING
+  DOCUMENTATION, IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS
+  IS". REGENTS HAS NO OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT,
+  UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+*/
+
+#include "accelcache.hpp"
+
+#include "collisionutil.hpp"
+#include "instance.hpp"
+using namespace std;
+
+AccelCache::~AccelCache () {
+    clear();
+}
+
+void AccelCache::clear () {
+    for (int e = 0; e < entries.size(); e++) {
+        delete entries[e].acc;
+        delete entries[e].instance_acc;
+    }
+    entries.clear();
+}
+
+vector<AccelStruct*> AccelCache::get (const vector<Mesh*> &meshes, bool ccd) {
+    vector<AccelStruct*> accs(meshes.size());
+    for (int m = 0; m < meshes.size(); m++)
+        accs[m] = get(*meshes[m], ccd);
+    return accs;
+}
+
+// records the positions the structure is fit to, and whether they changed
+static bool update_positions (vector<Vec3> &xs, const Mesh &mesh, bool ccd) {
+    int nn = mesh.nodes.size(), k = ccd ? 2 : 1;
+    if (xs.size() != k*nn) {
+        xs.resize(k*nn);
+        for (int n = 0; n < nn; n++) {
+            xs[k*n] = mesh.nodes[n]->x;
+            if (ccd)
+                xs[k*n+1] = mesh.nodes[n]->x0;
+        }
+        return true;
+    }
+    bool moved = false;
+#pragma omp parallel for reduction(||:moved)
+    for (int n = 0; n < nn; n++) {
+        const Node *node = mesh.nodes[n];
+        if (xs[k*n] != node->x || (ccd && xs[k*n+1] != node->x0)) {
+            xs[k*n] = node->x;
+            if (ccd)
+                xs[k*n+1] = node->x0;
+            moved = true;
+        }
+    }
+    return moved;
+}
+
+AccelCache::Entry &AccelCache::entry (const Mesh &mesh) {
+    for (int e = 0; e < entries.size(); e++)
+        if (entries[e].mesh == &mesh)
+            return entries[e];
+    Entry entry = {&mesh, -1, -1, 0, false, vector<Vec3>(), NULL, NULL, NULL};
+    entries.push_back(entry);
+    return entries.back();
+}
+
+void AccelCache::set_instance (const Mesh &mesh, RigidInstance *instance) {
+    Entry &entry = this->entry(mesh);
+    if (entry.instance != instance) {
+        delete entry.instance_acc;
+        entry.instance_acc = NULL;
+    }
+    entry.instance = instance;
+}
+
+RigidInstance *AccelCache::get_instance (const Mesh &mesh) {
+    RigidInstance *instance = entry(mesh).instance;
+    return instance && instance->attached ? instance : NULL;
+}
+
+AccelStruct *AccelCache::get (const Mesh &mesh, bool ccd) {
+    Entry &entry = this->entry(mesh);
+    if (entry.instance && entry.instance->attached) {
+        if (!entry.instance_acc)
+            entry.instance_acc = new AccelStruct(*entry.instance->base, false,
+                                                 entry.instance);
+        mark_all_active(*entry.instance_acc);
+        return entry.instance_acc;
+    }
+    if (entry.topology_version != mesh.topology_version
+        || entry.nfaces != mesh.faces.size()) {
+        delete entry.acc;
+        entry.acc = new AccelStruct(mesh, ccd);
+        entry.topology_version = mesh.topology_version;
+        entry.nfaces = mesh.faces.size();
+        entry.refits = 0;
+        entry.ccd = ccd;
+        entry.xs.clear();
+        update_positions(entry.xs, mesh, ccd);
+    } else if (entry.acc->root >= 0) {
+        if (entry.ccd != ccd || entry.refits != entry.acc->refits) {
+            entry.refits = entry.acc->refits;
+            entry.ccd = ccd;
+            entry.xs.clear();
+        }
+        if (update_positions(entry.xs, mesh, ccd)) {
+            entry.acc->tree._ccd = ccd;
+            entry.acc->tree.refit();
+        }
+        mark_all_active(*entry.acc);
+    }
+    return entry.acc;
+}
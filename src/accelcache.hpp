@@ -0,0 +1,67 @@
+/*
+  Copyright ©2013 The Regents of the University of California
+  (Regents). All Rights Reserved. Permission to use, copy, modify, and
+  distribute this software and its documentation for educational,
+  research, and not-for-profit purposes, without fee and without a
+  signed licensing agreement, is hereby granted, provided that the
+  above copyright notice, this paragraph and the following two
+  paragraphs appear in all copies, modifications, and
+  distributions. Contact The Office of Technology Licensing, UC
+  Berkeley, 2150 Shattuck Avenue, Suite 510, Berkeley, CA 94720-1620,
+  (510) 643-7201, for commercial licensing opportunities.
+
+  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT,
+  INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+  LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS
+  DOCUMENTATION, EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY
+  OF SUCH DAMAGE.
+
+  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING
+  DOCUMENTATION, IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS
+  IS". REGENTS HAS NO OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT,
+  UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+*/
+
+#ifndef ACCELCACHE_HPP
+#define ACCELCACHE_HPP
+
+#include "mesh.hpp"
+
+struct AccelStruct;
+struct RigidInstance;
+
+// Acceleration structures kept across calls. A mesh's structure is refit on
+// get() when its nodes have moved since the cache last refit it, or when it
+// has been refit elsewhere since, and only rebuilt when the mesh's topology
+// has changed since it was built. A mesh placed by an attached rigid
+// instance gets the structure of the instance's base mesh instead, which is
+// built once and never refit. The returned structures belong to the cache
+// and are all marked active.
+struct AccelCache {
+    AccelCache () {}
+    ~AccelCache ();
+    std::vector<AccelStruct*> get (const std::vector<Mesh*> &meshes, bool ccd);
+    void set_instance (const Mesh &mesh, RigidInstance *instance);
+    // the mesh's instance if it's attached, or NULL
+    RigidInstance *get_instance (const Mesh &mesh);
+    void clear ();
+private:
+    struct Entry {
+        const Mesh *mesh;
+        int topology_version, nfaces, refits;
+        bool ccd;
+        std::vector<Vec3> xs; // positions at the last refit, x0 too for ccd
+        AccelStruct *acc;
+        RigidInstance *instance;
+        AccelStruct *instance_acc;
+    };
+    std::vector<Entry> entries;
+    Entry &entry (const Mesh &mesh);
+    AccelStruct *get (const Mesh &mesh, bool ccd);
+    AccelCache (const AccelCache&);
+    AccelCache &operator= (const AccelCache&);
+};
+
+#endif
@@ -32,23 +32,35 @@
 using namespace std;
 using namespace alglib;
 
-static const NLConOpt *problem;
-static vector<double> lambda;
-static double mu;
+// The state of a solve is passed to alglib's callbacks, so that several
+// solves can run at once. When they do, each evaluates its constraints
+// serially.
+struct AugLag {
+    const NLConOpt *problem;
+    vector<double> lambda;
+    double mu;
+    int nthreads;
+    vector<double> values; // per-thread constraint terms
+    vector< vector<double> > grads;
+};
 
 static void auglag_value_and_grad (const real_1d_array &x, double &value,
-                                   real_1d_array &grad, void *ptr=NULL);
+                                   real_1d_array &grad, void *ptr);
 
-static void multiplier_update (const real_1d_array &x);
+static void multiplier_update (AugLag &auglag, const real_1d_array &x);
 
 void augmented_lagrangian_method (const NLConOpt &problem, OptOptions opt,
                                   bool verbose) {
-    ::problem = &problem;
-    ::lambda = vector<double>(::problem->ncon, 0);
-    ::mu = 1e3;
+    AugLag auglag;
+    auglag.problem = &problem;
+    auglag.lambda = vector<double>(problem.ncon, 0);
+    auglag.mu = 1e3;
+    auglag.nthreads = omp_in_parallel() ? 1 : omp_get_max_threads();
+    auglag.values.resize(auglag.nthreads);
+    auglag.grads.resize(auglag.nthreads);
     real_1d_array x;
-    x.setlength(::problem->nvar);
-    ::problem->initialize(&x[0]);
+    x.setlength(problem.nvar);
+    problem.initialize(&x[0]);
     mincgstate state;
     mincgreport rep;
     mincgcreate(x, state);
@@ -60,17 +72,17 @@ void augmented_lagrangian_method (const NLConOpt &problem, OptOptions opt,
         mincgsetcond(state, opt.eps_g(), opt.eps_f(), opt.eps_x(), max_iter);
         if (iter > 0)
             mincgrestartfrom(state, x);
-        mincgsuggeststep(state, 1e-3*::problem->nvar);
-        mincgoptimize(state, auglag_value_and_grad);
+        mincgsuggeststep(state, 1e-3*problem.nvar);
+        mincgoptimize(state, auglag_value_and_grad, NULL, &auglag);
         mincgresults(state, x, rep);
-        multiplier_update(x);
+        multiplier_update(auglag, x);
         if (verbose)
             cout << rep.iterationscount << " iterations" << endl;
         if (rep.iterationscount == 0)
             break;
         iter += rep.iterationscount;
     }
-    ::problem->finalize(&x[0]);
+    problem.finalize(&x[0]);
 }
 
 static void add (real_1d_array &x, const vector<double> &y) {
@@ -83,41 +95,45 @@ inline double clamp_violation (double x, int sign) {
 
 static void auglag_value_and_grad (const real_1d_array &x, double &value,
                                    real_1d_array &grad, void *ptr) {
-    ::problem->precompute(&x[0]);
-    value = ::problem->objective(&x[0]);
-    ::problem->obj_grad(&x[0], &grad[0]);
-    static const int nthreads = omp_get_max_threads();
-    static double *values = new double[nthreads];
-    static vector<double> *grads = new vector<double>[nthreads];
+    AugLag &auglag = *(AugLag*)ptr;
+    const NLConOpt *problem = auglag.problem;
+    problem->precompute(&x[0]);
+    value = problem->objective(&x[0]);
+    problem->obj_grad(&x[0], &grad[0]);
+    int nthreads = auglag.nthreads;
+    double *values = &auglag.values[0];
+    vector<double> *grads = &auglag.grads[0];
     for (int t = 0; t < nthreads; t++) {
         values[t] = 0;
-        grads[t].assign(::problem->nvar, 0);
+        grads[t].assign(problem->nvar, 0);
     }
-#pragma omp parallel for
-    for (int j = 0; j < ::problem->ncon; j++) {
+#pragma omp parallel for num_threads(nthreads)
+    for (int j = 0; j < problem->ncon; j++) {
         int t = omp_get_thread_num();
         int sign;
-        double gj = ::problem->constraint(&x[0], j, sign);
-        double cj = clamp_violation(gj + ::lambda[j]/::mu, sign);
+        double gj = problem->constraint(&x[0], j, sign);
+        double cj = clamp_violation(gj + auglag.lambda[j]/auglag.mu, sign);
         if (cj != 0) {
-            values[t] += ::mu/2*sq(cj);
-            ::problem->con_grad(&x[0], j, ::mu*cj, &grads[t][0]);
+            values[t] += auglag.mu/2*sq(cj);
+            problem->con_grad(&x[0], j, auglag.mu*cj, &grads[t][0]);
         }
     }
     for (int t = 0; t < nthreads; t++)
         value += values[t];
-#pragma omp parallel for
-    for (int i = 0; i < ::problem->nvar; i++)
+#pragma omp parallel for num_threads(nthreads)
+    for (int i = 0; i < problem->nvar; i++)
         for (int t = 0; t < nthreads; t++)
             grad[i] += grads[t][i];
 }
 
-static void multiplier_update (const real_1d_array &x) {
-    ::problem->precompute(&x[0]);
-#pragma omp parallel for
-    for (int j = 0; j < ::problem->ncon; j++) {
+static void multiplier_update (AugLag &auglag, const real_1d_array &x) {
+    const NLConOpt *problem = auglag.problem;
+    problem->precompute(&x[0]);
+#pragma omp parallel for num_threads(auglag.nthreads)
+    for (int j = 0; j < problem->ncon; j++) {
         int sign;
-        double gj = ::problem->constraint(&x[0], j, sign);
-        ::lambda[j] = clamp_violation(::lambda[j] + ::mu*gj, sign);
+        double gj = problem->constraint(&x[0], j, sign);
+        auglag.lambda[j] = clamp_violation(auglag.lambda[j] + auglag.mu*gj,
+                                           sign);
     }
 }
@@ -0,0 +1,94 @@
+/*
+  Copyright ©2013 The Regents of the University of California
+  (Regents). All Rights Reserved. Permission to use, copy, modify, and
+  distribute this software and its documentation for educational,
+  research, and not-for-profit purposes, without fee and without a
+  signed licensing agreement, is hereby granted, provided that the
+  above copyright notice, this paragraph and the following two
+  paragraphs appear in all copies, modifications, and
+  distributions. Contact The Office of Technology Licensing, UC
+  Berkeley, 2150 Shattuck Avenue, Suite 510, Berkeley, CA 94720-1620,
+  (510) 643-7201, for commercial licensing opportunities.
+
+  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT,
+  INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+  LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS
+  DOCUMENTATION, EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY
+  OF SUCH DAMAGE.
+
+  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING
+  DOCUMENTATION, IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS
+  IS". REGENTS HAS NO OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT,
+  UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+*/
+
+#ifndef BSR_HPP
+#define BSR_HPP
+
+#include "sparse.hpp"
+#include <algorithm>
+#include <vector>
+
+// Block compressed sparse row matrix. Unlike SpMat, the sparsity pattern
+// is built once up front and then stays fixed, so assembly only writes
+// into existing slots and never has to search or insert.
+
+template <typename T> struct BsrMat {
+    int m, n;
+    std::vector<int> rowptr; // row i is stored in slots rowptr[i]..rowptr[i+1]
+    std::vector<int> colind; // sorted within each row
+    std::vector<T> entries;
+    BsrMat (): m(0), n(0), rowptr(1, 0) {}
+    // cols[i] lists the columns present in row i, in any order and
+    // possibly with duplicates; it is sorted in place
+    void set_pattern (int m, int n, std::vector< std::vector<int> > &cols);
+    int slot (int i, int j) const; // -1 if (i,j) is not in the pattern
+    int nnz () const {return colind.size();}
+    void clear () {std::fill(entries.begin(), entries.end(), T(0));}
+    T operator() (int i, int j) const {
+        int k = slot(i, j);
+        return (k < 0) ? T(0) : entries[k];
+    }
+};
+
+template <typename T>
+void BsrMat<T>::set_pattern (int m, int n,
+                             std::vector< std::vector<int> > &cols) {
+    this->m = m;
+    this->n = n;
+    rowptr.resize(m+1);
+    colind.clear();
+    rowptr[0] = 0;
+    for (int i = 0; i < m; i++) {
+        std::vector<int> &row = cols[i];
+        std::sort(row.begin(), row.end());
+        row.erase(std::unique(row.begin(), row.end()), row.end());
+        colind.insert(colind.end(), row.begin(), row.end());
+        rowptr[i+1] = colind.size();
+    }
+    entries.assign(colind.size(), T(0));
+}
+
+template <typename T> int BsrMat<T>::slot (int i, int j) const {
+    std::vector<int>::const_iterator begin = colind.begin() + rowptr[i],
+                                     end = colind.begin() + rowptr[i+1],
+                                     it = std::lower_bound(begin, end, j);
+    return (it != end && *it == j) ? it - colind.begin() : -1;
+}
+
+template <typename T>
+std::ostream &operator<< (std::ostream &out, const BsrMat<T> &A) {
+    out << "[";
+    for (int i = 0; i < A.m; i++) {
+        for (int k = A.rowptr[i]; k < A.rowptr[i+1]; k++) {
+            out << (k==0 ? "" : ", ") << "(" << i << "," << A.colind[k]
+                << "): " << A.entries[k];
+        }
+    }
+    out << "]";
+    return out;
+}
+
+#endif
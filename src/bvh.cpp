@@ -48,11 +48,108 @@
 #include "bvh.hpp"
 #include "collision.hpp"
 #include "mesh.hpp"
+#include <algorithm>
 #include <climits>
+#include <iterator>
 #include <utility>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BVH_AVX
+#include <immintrin.h>
+#endif
 using namespace std;
 
+// The box construction, union and overlap kernels below have AVX versions,
+// used when the CPU supports them. They round and compare exactly like the
+// scalar kDOP18 code, so both give bit-identical boxes and answers.
+
+#ifdef BVH_AVX
+static bool cpu_has_avx () {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx");
+}
+static const bool use_avx = cpu_has_avx();
+
+// first 8 slabs in one register, the 9th separately
+struct Slabs {
+    __m256 lo, hi;
+    float lo8, hi8;
+};
+
+__attribute__((target("avx")))
+static inline __m256 combine (__m128 lo, __m128 hi) {
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+}
+
+__attribute__((target("avx")))
+static inline void add_point (Slabs &s, const Vec3 &p) {
+    // projections computed in double and rounded to float, as getDistances()
+    __m256d d0 = _mm256_setr_pd(p[0], p[1], p[2], p[0]+p[1]),
+            d1 = _mm256_setr_pd(p[0]+p[2], p[1]+p[2], p[0]-p[1], p[0]-p[2]);
+    __m256 d = combine(_mm256_cvtpd_ps(d0), _mm256_cvtpd_ps(d1));
+    float d8 = p[1]-p[2];
+    s.lo = _mm256_min_ps(d, s.lo);
+    s.hi = _mm256_max_ps(d, s.hi);
+    s.lo8 = MIN(d8, s.lo8);
+    s.hi8 = MAX(d8, s.hi8);
+}
+
+__attribute__((target("avx")))
+static BOX nodes_box_avx (const Node *const *nodes, int n, bool ccd) {
+    Slabs s = {_mm256_set1_ps(FLT_MAX), _mm256_set1_ps(-FLT_MAX),
+               FLT_MAX, -FLT_MAX};
+    for (int i = 0; i < n; i++) {
+        add_point(s, nodes[i]->x);
+        if (ccd)
+            add_point(s, nodes[i]->x0);
+    }
+    BOX box;
+    _mm256_storeu_ps(&box._dist[0], s.lo);
+    _mm256_storeu_ps(&box._dist[9], s.hi);
+    box._dist[8] = s.lo8;
+    box._dist[17] = s.hi8;
+    return box;
+}
+
+__attribute__((target("avx")))
+static void merge_avx (const BOX &box0, const BOX &box1, BOX &box) {
+    const float *a = box0._dist, *b = box1._dist;
+    // same operand order as box0 + box1
+    __m256 lo = _mm256_min_ps(_mm256_loadu_ps(b), _mm256_loadu_ps(a)),
+           hi = _mm256_max_ps(_mm256_loadu_ps(b+9), _mm256_loadu_ps(a+9));
+    float lo8 = MIN(b[8], a[8]), hi8 = MAX(b[17], a[17]);
+    _mm256_storeu_ps(&box._dist[0], lo);
+    _mm256_storeu_ps(&box._dist[9], hi);
+    box._dist[8] = lo8;
+    box._dist[17] = hi8;
+}
+
+__attribute__((target("avx")))
+static bool overlap_avx (const BOX &box0, const BOX &box1, double d) {
+    static const double sqrt2 = sqrt(2);
+    const float *a = box0._dist, *b = box1._dist;
+    // dilate box1 in double and round back, as dilate()
+    __m256d d0 = _mm256_setr_pd(d, d, d, sqrt2*d), d1 = _mm256_set1_pd(sqrt2*d);
+    __m256 blo = combine(
+        _mm256_cvtpd_ps(_mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(b)), d0)),
+        _mm256_cvtpd_ps(_mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(b+4)), d1)));
+    __m256 bhi = combine(
+        _mm256_cvtpd_ps(_mm256_add_pd(_mm256_cvtps_pd(_mm_loadu_ps(b+9)), d0)),
+        _mm256_cvtpd_ps(_mm256_add_pd(_mm256_cvtps_pd(_mm_loadu_ps(b+13)),d1)));
+    __m256 apart = _mm256_or_ps(
+        _mm256_cmp_ps(_mm256_loadu_ps(a), bhi, _CMP_GT_OQ),
+        _mm256_cmp_ps(_mm256_loadu_ps(a+9), blo, _CMP_LT_OQ));
+    if (_mm256_movemask_ps(apart))
+        return false;
+    float blo8 = b[8] - sqrt2*d, bhi8 = b[17] + sqrt2*d;
+    return !(a[8] > bhi8 || a[17] < blo8);
+}
+#endif
+
 BOX node_box (const Node *node, bool ccd) {
+#ifdef BVH_AVX
+    if (use_avx)
+        return nodes_box_avx(&node, 1, ccd);
+#endif
     BOX box;
     box += node->x;
     if (ccd)
@@ -65,6 +162,10 @@ BOX vert_box (const Vert *vert, bool ccd) {
 }
 
 BOX edge_box (const Edge *edge, bool ccd) {
+#ifdef BVH_AVX
+    if (use_avx)
+        return nodes_box_avx(edge->n, 2, ccd);
+#endif
     BOX box;
     box += node_box(edge->n[0], ccd);
     box += node_box(edge->n[1], ccd);
@@ -72,12 +173,29 @@ BOX edge_box (const Edge *edge, bool ccd) {
 }
 
 BOX face_box (const Face *face, bool ccd) {
+#ifdef BVH_AVX
+    if (use_avx) {
+        const Node *nodes[3] = {face->v[0]->node, face->v[1]->node,
+                                face->v[2]->node};
+        return nodes_box_avx(nodes, 3, ccd);
+    }
+#endif
     BOX box;
     for (int v = 0; v < 3; v++)
         box += vert_box(face->v[v], ccd);
     return box;
 }
 
+static void merge (const BOX &box0, const BOX &box1, BOX &box) {
+#ifdef BVH_AVX
+    if (use_avx) {
+        merge_avx(box0, box1, box);
+        return;
+    }
+#endif
+    box = box0 + box1;
+}
+
 BOX dilate (const BOX &box, double d) {
     static double sqrt2 = sqrt(2);
     BOX dbox = box;
@@ -93,13 +211,69 @@ BOX dilate (const BOX &box, double d) {
 }
 
 bool overlap (const BOX &box0, const BOX &box1, float thickness) {
+#ifdef BVH_AVX
+    if (use_avx)
+        return overlap_avx(box0, box1, thickness);
+#endif
     return box0.overlaps(dilate(box1, thickness));
 }
 
+// cosine of the sum of two angles below 90 degrees, given their cosines
+static double add_angles (double c0, double c1) {
+	if (c0 <= 0 || c1 <= 0)
+		return 0;
+	return c0*c1 - sqrt(max(1 - c0*c0, 0.))*sqrt(max(1 - c1*c1, 0.));
+}
+
+static NormalCone face_cone (const Face *face, bool ccd) {
+	const Node *n0 = face->v[0]->node, *n1 = face->v[1]->node,
+	           *n2 = face->v[2]->node;
+	vec3f e1 = n1->x - n0->x, e2 = n2->x - n0->x;
+	NormalCone cone = {normalize(cross(e1, e2)), 1};
+	if (!ccd) {
+		cone.cos = norm2(cone.axis) > 0 ? 1 : 0;
+		return cone;
+	}
+	// the normal is quadratic in time, and a positive combination of its
+	// Bernstein coefficients
+	vec3f f1 = n1->x0 - n0->x0, f2 = n2->x0 - n0->x0;
+	vec3f ns[3] = {normalize(cross(f1, f2)),
+	               normalize(cross(f1, e2) + cross(e1, f2)), cone.axis};
+	cone.axis = normalize(ns[0] + ns[1] + ns[2]);
+	for (int k = 0; k < 3; k++)
+		if (k != 1 || norm2(ns[k]) > 0)
+			cone.cos = min(cone.cos, dot(cone.axis, ns[k]));
+	return cone;
+}
+
+static NormalCone merge_cones (const NormalCone &c0, const NormalCone &c1) {
+	NormalCone cone = {normalize(c0.axis + c1.axis), 0};
+	cone.cos = min(add_angles(dot(cone.axis, c0.axis), c0.cos),
+	               add_angles(dot(cone.axis, c1.axis), c1.cos));
+	return cone;
+}
+
 float
 DeformBVHTree::refit()
 {
-	getRoot()->refit(_ccd);
+	// children come after their parents, so one backward sweep suffices
+	for (int i = (int)_nodes.size()-1; i >= 0; i--) {
+		if (isLeaf(i)) {
+			_boxes[i] = face_box(getFace(i), _ccd);
+			_cones[i] = face_cone(getFace(i), _ccd);
+		} else {
+			int left = getLeftChild(i), right = getRightChild(i);
+			merge(_boxes[left], _boxes[right], _boxes[i]);
+			_cones[i] = merge_cones(_cones[left], _cones[right]);
+		}
+	}
+	// and a forward one to find the largest self-free subtrees
+	for (int i = 0; i < _nodes.size(); i++) {
+		int parent = getParent(i);
+		_selfFree[i] = (parent >= 0 && _selfFree[parent])
+		            || (_cones[i].cos > 0 && !_contours[i].empty()
+		                && contourSimple(i));
+	}
 
 	return 0.f;
 }
@@ -107,7 +281,7 @@ DeformBVHTree::refit()
 BOX
 DeformBVHTree::box()
 {
-	return getRoot()->_box;
+	return _boxes[0];
 }
 
 inline vec3f norm(vec3f &p1, vec3f &p2, vec3f &p3)
@@ -118,253 +292,404 @@ inline vec3f norm(vec3f &p1, vec3f &p2, vec3f &p3)
 	return n;
 }
 
-void
-DeformBVHNode::refit(bool ccd)
-{
-	if (isLeaf()) {
-		_box = face_box(getFace(), ccd);
-	} else {
-		getLeftChild()->refit(ccd);
-		getRightChild()->refit(ccd);
-
-		_box = getLeftChild()->_box + getRightChild()->_box;
-	}
-}
-
-bool
-DeformBVHNode::find(Face *face)
+DeformBVHTree::DeformBVHTree(DeformModel &mdl, bool ccd)
 {
-	if (isLeaf())
-		return getFace() == face;
-
-	if (getLeftChild()->find(face))
-		return true;
-
-	if (getRightChild()->find(face))
-		return true;
+    _mdl = &mdl;
+    _ccd = ccd;
 
-	return false;
+    if (!mdl.verts.empty() && !mdl.faces.empty())
+        Construct();
 }
 
-inline float middle_xyz(char xyz, const vec3f &p1, const vec3f &p2, const vec3f &p3)
-{
-	float t0, t1;
+// The hierarchy is built top-down with a binned surface area heuristic.
+// A subtree over k faces takes up 2k-1 consecutive nodes in depth-first
+// order, so the two subtrees of a node have known ranges and large ones are
+// built as concurrent tasks.
+
+static const int nbins = 16;
+static const int sah_faces = 16; // smaller nodes are split at the midpoint
+static const int task_faces = 1024; // smaller subtrees are built serially
+
+// axis-aligned bounds of faces and bins
+struct BuildBounds {
+	vec3f lo, hi;
+	BuildBounds (): lo(infinity), hi(-infinity) {}
+	void add (const vec3f &p) {
+		for (int k = 0; k < 3; k++) {
+			lo[k] = min(lo[k], p[k]);
+			hi[k] = max(hi[k], p[k]);
+		}
+	}
+	void add (const BuildBounds &b) {
+		for (int k = 0; k < 3; k++) {
+			lo[k] = min(lo[k], b.lo[k]);
+			hi[k] = max(hi[k], b.hi[k]);
+		}
+	}
+	double area () const {
+		if (lo[0] > hi[0])
+			return 0;
+		vec3f d = hi - lo;
+		return d[0]*d[1] + d[1]*d[2] + d[2]*d[0];
+	}
+};
 
-	t0 = MIN(p1[xyz], p2[xyz]);
-	t0 = MIN(t0, p3[xyz]);
-	t1 = MAX(p1[xyz], p2[xyz]);
-	t1 = MAX(t1, p3[xyz]);
-	return (t0+t1)*0.5f;
+// splits at the middle of the longest axis of the face centers' bounds
+static int midpoint_split (int *faces, int n, const BuildBounds &cb,
+                           const vec3f *centers) {
+	int k = 0;
+	for (int j = 1; j < 3; j++)
+		if (cb.hi[j] - cb.lo[j] > cb.hi[k] - cb.lo[k])
+			k = j;
+	double mid = (cb.lo[k] + cb.hi[k])/2;
+	int nleft = 0;
+	for (int i = 0; i < n; i++)
+		if (centers[faces[i]][k] < mid)
+			swap(faces[i], faces[nleft++]);
+	return (nleft == 0 || nleft == n) ? n/2 : nleft;
 }
 
-class aap {
-public:
-	char _xyz;
-	float _p;
-
-	FORCEINLINE aap(const BOX &total) {
-		vec3f center = total.center();
-		char xyz = 2;
-
-		if (total.width() >= total.height() && total.width() >= total.depth()) {
-			xyz = 0;
-		} else
-		if (total.height() >= total.width() && total.height() >= total.depth()) {
-			xyz = 1;
+// reorders faces so that the first returned-many go in the left subtree
+static int sah_split (int *faces, int n, const BuildBounds *bounds,
+                      const vec3f *centers) {
+	BuildBounds cb;
+	for (int i = 0; i < n; i++)
+		cb.add(centers[faces[i]]);
+	if (n <= sah_faces)
+		return midpoint_split(faces, n, cb, centers);
+	vec3f scale;
+	for (int k = 0; k < 3; k++) {
+		double extent = cb.hi[k] - cb.lo[k];
+		scale[k] = extent > 0 ? nbins/extent : 0;
+	}
+	BuildBounds bins[3][nbins];
+	int counts[3][nbins] = {{0}};
+	for (int i = 0; i < n; i++) {
+		int f = faces[i];
+		for (int k = 0; k < 3; k++) {
+			int b = min((int)((centers[f][k] - cb.lo[k])*scale[k]), nbins-1);
+			bins[k][b].add(bounds[f]);
+			counts[k][b]++;
 		}
-
-		_xyz = xyz;
-		_p = center[xyz];
 	}
-
-	FORCEINLINE bool inside(const vec3f &mid) const {
-		return mid[_xyz]>_p;
+	double best_cost = infinity;
+	int best_axis = -1, best_bin = 0;
+	for (int k = 0; k < 3; k++) {
+		if (scale[k] == 0)
+			continue;
+		// cost of splitting after bin b, from both sides
+		double right_area[nbins];
+		int right_count[nbins];
+		BuildBounds acc;
+		int count = 0;
+		for (int b = nbins-1; b > 0; b--) {
+			acc.add(bins[k][b]);
+			count += counts[k][b];
+			right_area[b] = acc.area();
+			right_count[b] = count;
+		}
+		acc = BuildBounds();
+		count = 0;
+		for (int b = 0; b < nbins-1; b++) {
+			acc.add(bins[k][b]);
+			count += counts[k][b];
+			if (count == 0 || count == n)
+				continue;
+			double cost = acc.area()*count
+			            + right_area[b+1]*right_count[b+1];
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = k;
+				best_bin = b;
+			}
+		}
 	}
-};
-
-extern float middle_xyz(char xyz, const vec3f &p1, const vec3f &p2, const vec3f &p3);
+	if (best_axis < 0) // all centers coincide
+		return n/2;
+	int k = best_axis, nleft = 0;
+	for (int i = 0; i < n; i++) {
+		int b = min((int)((centers[faces[i]][k] - cb.lo[k])*scale[k]),
+		            nbins-1);
+		if (b <= best_bin)
+			swap(faces[i], faces[nleft++]);
+	}
+	return nleft;
+}
 
-DeformBVHTree::DeformBVHTree(DeformModel &mdl, bool ccd)
+// sets up the nodes' topology; their boxes are filled in by refit()
+void
+DeformBVHTree::build(int node, int parent, int *faces, int n,
+                     const BuildBounds *bounds, const vec3f *centers)
 {
-    _mdl = &mdl;
-    _ccd = ccd;
-
-    if (!mdl.verts.empty())
-        Construct();
-    else
-        _root = NULL;
+	_nodes[node]._parent = parent;
+	if (n == 1) {
+		_nodes[node]._child = ~faces[0];
+		return;
+	}
+	int nleft = sah_split(faces, n, bounds, centers);
+	int left = node + 1, right = node + 2*nleft;
+	_nodes[node]._child = right;
+	if (n > task_faces) {
+#pragma omp task
+		build(left, node, faces, nleft, bounds, centers);
+		build(right, node, faces + nleft, n - nleft, bounds, centers);
+#pragma omp taskwait
+	} else {
+		build(left, node, faces, nleft, bounds, centers);
+		build(right, node, faces + nleft, n - nleft, bounds, centers);
+	}
 }
 
 void
 DeformBVHTree::Construct()
 {
-	BOX total;
-	int count;
-
-    int num_vtx = _mdl->verts.size(),
-        num_tri = _mdl->faces.size();
-
-    for (unsigned int i=0; i<num_vtx; i++) {
-        total += _mdl->verts[i]->node->x;
-        if (_ccd)
-            total += _mdl->verts[i]->node->x0;
-    }
-
-    count = num_tri;
-
-	BOX *tri_boxes = new BOX[count];
-	vec3f *tri_centers = new vec3f[count];
-
-	aap  pln(total);
-
-	face_buffer = new Face*[count];
-	unsigned int left_idx = 0, right_idx = count;
-	unsigned int tri_idx = 0;
-
-	for (unsigned int i=0; i<num_tri; i++) {
-        tri_idx++;
-
-		vec3f &p1 = _mdl->faces[i]->v[0]->node->x;
-		vec3f &p2 = _mdl->faces[i]->v[1]->node->x;
-		vec3f &p3 = _mdl->faces[i]->v[2]->node->x;
-		vec3f &pp1 = _mdl->faces[i]->v[0]->node->x0;
-		vec3f &pp2 = _mdl->faces[i]->v[1]->node->x0;
-		vec3f &pp3 = _mdl->faces[i]->v[2]->node->x0;
-
-		if (_ccd) {
-
-			tri_centers[tri_idx-1] = vec3f(
-				(middle_xyz(0, p1, p2, p3)+middle_xyz(0, pp1, pp2, pp3))*0.5f,
-				(middle_xyz(1, p1, p2, p3)+middle_xyz(1, pp1, pp2, pp3))*0.5f,
-				(middle_xyz(2, p1, p2, p3)+middle_xyz(2, pp1, pp2, pp3))*0.5f);
-		} else {
-			tri_centers[tri_idx-1] = vec3f(
-				middle_xyz(0, p1, p2, p3),
-				middle_xyz(1, p1, p2, p3),
-				middle_xyz(2, p1, p2, p3));
+	int count = _mdl->faces.size();
+	vector<BuildBounds> bounds(count);
+	vector<vec3f> centers(count);
+	vector<int> faces(count);
+#pragma omp parallel for if (count > task_faces)
+	for (int f = 0; f < count; f++) {
+		const Face *face = _mdl->faces[f];
+		for (int v = 0; v < 3; v++) {
+			bounds[f].add(face->v[v]->node->x);
+			if (_ccd)
+				bounds[f].add(face->v[v]->node->x0);
 		}
+		centers[f] = (bounds[f].lo + bounds[f].hi)/2.;
+		faces[f] = f;
+	}
+	// a binary tree over count leaves has 2*count-1 nodes
+	_nodes.resize(2*count-1);
+	_boxes.resize(2*count-1);
+#pragma omp parallel if (count > task_faces)
+#pragma omp single
+	build(0, -1, &faces[0], count, &bounds[0], &centers[0]);
+	_active.assign(_nodes.size(), true);
+	_cones.resize(_nodes.size());
+	_selfFree.resize(_nodes.size());
+	buildContours();
+	refit();
+}
 
-		if (pln.inside(tri_centers[tri_idx-1]))
-			face_buffer[left_idx++] = _mdl->faces[i];
-		else
-			face_buffer[--right_idx] = _mdl->faces[i];
-
-		tri_boxes[tri_idx-1] += p1;
-		tri_boxes[tri_idx-1] += p2;
-		tri_boxes[tri_idx-1] += p3;
+// Boundary contours are found bottom-up: a subtree's boundary edges are
+// those of only one of its children. Longer contours than max_contour edges
+// are neither kept nor tested.
+
+static const int max_contour = 256;
+
+// whether the edges form one closed loop
+static bool single_loop (const vector<int> &contour,
+                         const vector<Edge*> &edges) {
+	int m = contour.size();
+	if (m < 3)
+		return false;
+	vector< pair<int,int> > ends; // (node, position in contour)
+	for (int k = 0; k < m; k++)
+		for (int j = 0; j < 2; j++)
+			ends.push_back(make_pair(edges[contour[k]]->n[j]->index, k));
+	sort(ends.begin(), ends.end());
+	for (int i = 0; i < 2*m; i += 2)
+		if (ends[i].first != ends[i+1].first
+		 || (i+2 < 2*m && ends[i+2].first == ends[i].first))
+			return false;
+	// every node is on two edges; walk around from the first one
+	int k = 0, node = edges[contour[0]]->n[1]->index, steps = 1;
+	while (true) {
+		int i = lower_bound(ends.begin(), ends.end(), make_pair(node, -1))
+		      - ends.begin();
+		int next = ends[i].second == k ? ends[i+1].second : ends[i].second;
+		if (next == 0)
+			break;
+		const Edge *edge = edges[contour[next]];
+		node = edge->n[0]->index == node ? edge->n[1]->index
+		                                 : edge->n[0]->index;
+		k = next;
+		steps++;
+	}
+	return steps == m;
+}
 
-		if (_ccd) {
-			tri_boxes[tri_idx-1] += pp1;
-			tri_boxes[tri_idx-1] += pp2;
-			tri_boxes[tri_idx-1] += pp3;
+void
+DeformBVHTree::buildContours()
+{
+	int n = _nodes.size();
+	_contours.assign(n, vector<int>());
+	vector<char> overflow(n, false);
+	for (int i = n-1; i >= 0; i--) {
+		vector<int> &contour = _contours[i];
+		if (isLeaf(i)) {
+			const Face *face = getFace(i);
+			for (int e = 0; e < 3; e++)
+				contour.push_back(face->adje[e]->index);
+			sort(contour.begin(), contour.end());
+			continue;
+		}
+		const vector<int> &left = _contours[getLeftChild(i)],
+		                  &right = _contours[getRightChild(i)];
+		overflow[i] = overflow[getLeftChild(i)] || overflow[getRightChild(i)];
+		if (!overflow[i])
+			set_symmetric_difference(left.begin(), left.end(),
+			                         right.begin(), right.end(),
+			                         back_inserter(contour));
+		if (contour.size() > max_contour) {
+			overflow[i] = true;
+			contour.clear();
 		}
 	}
+	// leaves never need testing
+	for (int i = 0; i < n; i++)
+		if (isLeaf(i) || !single_loop(_contours[i], _mdl->edges))
+			vector<int>().swap(_contours[i]);
+}
 
-	_root = new DeformBVHNode();
-	_root->_box = total;
-	//_root->_count = count;
+// A contour edge projected on the plane, with its endpoints at the start
+// and end of the step.
+struct ContourEdge {
+	Vec2 x0[2], x1[2];
+	int n[2];
+	Vec2 lo, hi;
+};
 
-	if (count == 1) {
-		_root->_face = _mdl->faces[0];
-		_root->_left = _root->_right = NULL;
-	} else {
-		if (left_idx == 0 || left_idx == count)
-			left_idx = count/2;
+static Vec2 at (const Vec2 &x0, const Vec2 &x1, double t) {
+	return x0 + t*(x1 - x0);
+}
 
-		_root->_left = new DeformBVHNode(_root, face_buffer, left_idx, tri_boxes, tri_centers);
-		_root->_right = new DeformBVHNode(_root, face_buffer+left_idx, count-left_idx, tri_boxes, tri_centers);
+// Times in [0,1] when the linearly moving points a, b, c are collinear.
+// Their signed area is quadratic in time. Returns -1 if it stays zero.
+static int collinear_times (const Vec2 a[2], const Vec2 b[2], const Vec2 c[2],
+                            double t[2]) {
+	double f[3];
+	for (int k = 0; k < 3; k++) {
+		Vec2 ak = at(a[0], a[1], k/2.);
+		f[k] = wedge(at(b[0], b[1], k/2.) - ak, at(c[0], c[1], k/2.) - ak);
 	}
-
-	delete [] tri_boxes;
-	delete [] tri_centers;
+	double qa = 2*f[2] - 4*f[1] + 2*f[0], qb = f[2] - f[0] - qa, qc = f[0];
+	double roots[2];
+	int nroots = 0;
+	if (qa != 0) {
+		double disc = qb*qb - 4*qa*qc;
+		if (disc >= 0) {
+			double q = -(qb + (qb >= 0 ? 1 : -1)*sqrt(disc))/2;
+			roots[nroots++] = q/qa;
+			if (q != 0)
+				roots[nroots++] = qc/q;
+		}
+	} else if (qb != 0)
+		roots[nroots++] = -qc/qb;
+	else if (qc == 0)
+		return -1;
+	int n = 0;
+	for (int r = 0; r < nroots; r++)
+		if (roots[r] >= 0 && roots[r] <= 1)
+			t[n++] = roots[r];
+	return n;
 }
 
-DeformBVHTree::~DeformBVHTree()
-{
-    if (!_root)
-        return;
-	delete _root;
-	delete [] face_buffer;
+// whether moving point p meets the moving segment qr
+static bool point_crosses (const Vec2 p[2], const Vec2 q[2], const Vec2 r[2]) {
+	static const double eps = 1e-6;
+	double t[2];
+	int n = collinear_times(p, q, r, t);
+	if (n < 0)
+		return true;
+	for (int i = 0; i < n; i++) {
+		Vec2 pt = at(p[0], p[1], t[i]), qt = at(q[0], q[1], t[i]),
+		     rt = at(r[0], r[1], t[i]);
+		double l2 = norm2(rt - qt);
+		if (l2 == 0)
+			return true;
+		double s = dot(pt - qt, rt - qt)/l2;
+		if (s >= -eps && s <= 1 + eps)
+			return true;
+	}
+	return false;
 }
 
-//#################################################################
-// called by root
-DeformBVHNode::DeformBVHNode()
-{
-	_face = NULL;
-	_left = _right = NULL;
-	_parent = NULL;
-	//_count = 0;
-    _active = true;
+static bool segments_intersect (const Vec2 &p0, const Vec2 &p1,
+                                const Vec2 &q0, const Vec2 &q1) {
+	double a0 = wedge(p1 - p0, q0 - p0), a1 = wedge(p1 - p0, q1 - p0),
+	       b0 = wedge(q1 - q0, p0 - q0), b1 = wedge(q1 - q0, p1 - q0);
+	return a0*a1 <= 0 && b0*b1 <= 0;
 }
 
-DeformBVHNode::~DeformBVHNode()
-{
-	if (_left) delete _left;
-	if (_right) delete _right;
+// whether two contour edges touch during the step, other than at a shared
+// node, conservatively
+static bool edges_cross (const ContourEdge &e0, const ContourEdge &e1) {
+	for (int i = 0; i < 2; i++)
+		for (int j = 0; j < 2; j++)
+			if (e0.n[i] == e1.n[j]) {
+				// adjacent edges only meet by folding onto each other
+				Vec2 s[2] = {e0.x0[i], e0.x1[i]},
+				     p[2] = {e0.x0[1-i], e0.x1[1-i]},
+				     q[2] = {e1.x0[1-j], e1.x1[1-j]};
+				double t[2];
+				int n = collinear_times(s, p, q, t);
+				if (n < 0)
+					return true;
+				for (int k = 0; k < n; k++) {
+					Vec2 st = at(s[0], s[1], t[k]);
+					if (dot(at(p[0], p[1], t[k]) - st,
+					        at(q[0], q[1], t[k]) - st) > 0)
+						return true;
+				}
+				return false;
+			}
+	if (segments_intersect(e0.x0[0], e0.x0[1], e1.x0[0], e1.x0[1]))
+		return true;
+	// otherwise they first touch when an endpoint meets the other edge
+	for (int i = 0; i < 2; i++) {
+		Vec2 p[2] = {e0.x0[i], e0.x1[i]},
+		     q[2] = {e1.x0[0], e1.x1[0]}, r[2] = {e1.x0[1], e1.x1[1]};
+		if (point_crosses(p, q, r))
+			return true;
+		Vec2 p1[2] = {e1.x0[i], e1.x1[i]},
+		     q1[2] = {e0.x0[0], e0.x1[0]}, r1[2] = {e0.x0[1], e0.x1[1]};
+		if (point_crosses(p1, q1, r1))
+			return true;
+	}
+	return false;
 }
 
-// called by leaf
-DeformBVHNode::DeformBVHNode(DeformBVHNode *parent, Face *face, BOX *tri_boxes, vec3f *tri_centers)
-{
-	_left = _right = NULL;
-	_parent = parent;
-	_face = face;
-    _box = tri_boxes[face->index];
-	//_count = 1;
-    _active = true;
+static bool by_lo (const ContourEdge &e0, const ContourEdge &e1) {
+	return e0.lo[0] < e1.lo[0];
 }
 
-// called by nodes
-DeformBVHNode::DeformBVHNode(DeformBVHNode *parent, Face **lst, unsigned int lst_num, BOX *tri_boxes, vec3f *tri_centers)
+// whether the contour of subtree i stays a simple curve throughout the
+// step, projected along its cone's axis
+bool
+DeformBVHTree::contourSimple(int i) const
 {
-	assert(lst_num > 0);
-	_left = _right = NULL;
-	_parent = parent;
-	_face = NULL;
-	//_count = lst_num;
-    _active = true;
-
-	if (lst_num == 1) {
-		_face = lst[0];
-		_box = tri_boxes[lst[0]->index];
-	}
-	else { // try to split them
-		for (unsigned int t=0; t<lst_num; t++) {
-			int i=lst[t]->index;
-			_box += tri_boxes[i];
+	const vector<int> &contour = _contours[i];
+	const vec3f &axis = _cones[i].axis;
+	vec3f u = normalize(cross(axis, abs(axis[0]) < 0.5 ? vec3f(1,0,0)
+	                                                   : vec3f(0,1,0)));
+	vec3f v = cross(axis, u);
+	int m = contour.size();
+	vector<ContourEdge> edges(m);
+	for (int k = 0; k < m; k++) {
+		const Edge *edge = _mdl->edges[contour[k]];
+		ContourEdge &e = edges[k];
+		for (int j = 0; j < 2; j++) {
+			const Node *node = edge->n[j];
+			e.n[j] = node->index;
+			e.x1[j] = Vec2(dot(node->x, u), dot(node->x, v));
+			e.x0[j] = _ccd ? Vec2(dot(node->x0, u), dot(node->x0, v))
+			               : e.x1[j];
 		}
-
-		if (lst_num == 2) { // must split it!
-			_left = new DeformBVHNode(this, lst[0], tri_boxes, tri_centers);
-			_right = new DeformBVHNode(this, lst[1], tri_boxes, tri_centers);
-		} else {
-			aap pln(_box);
-			unsigned int left_idx = 0, right_idx = lst_num-1;
-
-			for (unsigned int t=0; t<lst_num; t++) {
-				int i=lst[left_idx]->index;
-				if (pln.inside(tri_centers[i]))
-					left_idx++;
-				else {// swap it
-					Face *tmp = lst[left_idx];
-					lst[left_idx] = lst[right_idx];
-					lst[right_idx--] = tmp;
-				}
-			}
-
-			int hal = lst_num/2;
-			if (left_idx == 0 || left_idx == lst_num)
-			{
-				_left = new DeformBVHNode(this, lst, hal, tri_boxes, tri_centers);
-				_right = new DeformBVHNode(this, lst+hal, lst_num-hal, tri_boxes, tri_centers);
-
-			}
-			else {
-				_left = new DeformBVHNode(this, lst, left_idx, tri_boxes, tri_centers);
-				_right = new DeformBVHNode(this, lst+left_idx, lst_num-left_idx, tri_boxes, tri_centers);
-			}
-
+		for (int c = 0; c < 2; c++) {
+			e.lo[c] = min(min(e.x0[0][c], e.x0[1][c]),
+			              min(e.x1[0][c], e.x1[1][c]));
+			e.hi[c] = max(max(e.x0[0][c], e.x0[1][c]),
+			              max(e.x1[0][c], e.x1[1][c]));
 		}
 	}
+	// sweep along the first axis to skip pairs whose boxes don't overlap
+	sort(edges.begin(), edges.end(), by_lo);
+	for (int a = 0; a < m; a++)
+		for (int b = a+1; b < m && edges[b].lo[0] <= edges[a].hi[0]; b++)
+			if (edges[b].lo[1] <= edges[a].hi[1]
+			 && edges[a].lo[1] <= edges[b].hi[1]
+			 && edges_cross(edges[a], edges[b]))
+				return false;
+	return true;
 }
@@ -263,67 +263,77 @@ BOX node_box (const Node *node, bool ccd);
 BOX edge_box (const Edge *edge, bool ccd);
 BOX face_box (const Face *face, bool ccd);
 
+BOX dilate (const BOX &box, double d);
 bool overlap (const BOX &box0, const BOX &box1, float thickness);
 
 // ostream &operator<< (ostream &out, const BOX &box) {out << "["<<box._dist[0]<<", "<<box._dist[9]<<"] x ["<<box._dist[1]<<", "<<box._dist[10]<<"] x ["<<box._dist[2]<<", "<<box._dist[11]<<"]"; return out;}
 
-class DeformBVHNode;
 typedef Mesh DeformModel;
 
-class DeformBVHNode {
-public:
-	BOX _box;
-
-	Face *_face;
-
-	DeformBVHNode *_parent;
-	DeformBVHNode *_left;
-	DeformBVHNode *_right;
-
-    bool _active;
-
-public:
-	DeformBVHNode();
-	DeformBVHNode(DeformBVHNode *, Face *, BOX *, vec3f *);
-	DeformBVHNode(DeformBVHNode *, Face **, unsigned int, BOX *, vec3f *);
-
-	~DeformBVHNode();
-
-	void refit(bool=false);
-	bool find(Face *);
-
-	FORCEINLINE DeformBVHNode *getLeftChild() { return _left; }
-	FORCEINLINE DeformBVHNode *getRightChild() { return _right; }
-	FORCEINLINE DeformBVHNode *getParent() { return _parent; }
+// Nodes are stored contiguously in depth-first order, so the left child of an
+// internal node is the node right after it and every child comes after its
+// parent. Each node only keeps the index of its right child, or the bitwise
+// complement of its face's index for leaves. Bounds and activity flags live
+// in separate arrays indexed like the nodes.
+struct DeformBVHNode {
+	int _child;
+	int _parent; // -1 at the root
+
+	FORCEINLINE bool isLeaf() const { return _child < 0; }
+	FORCEINLINE bool isRoot() const { return _parent < 0; }
+	FORCEINLINE int getRightChild() const { return _child; }
+	FORCEINLINE int getFaceIndex() const { return ~_child; }
+};
 
-	FORCEINLINE Face *getFace() { return _face; }
-	FORCEINLINE bool isLeaf() { return _left == NULL; }
-	FORCEINLINE bool isRoot() { return _parent == NULL;}
+struct BuildBounds;
 
-friend class DeformBVHTree;
+// Cone holding the directions of a subtree's face normals, over the whole
+// timestep for ccd trees. A nonpositive cos means the half-angle is not
+// below 90 degrees.
+struct NormalCone {
+	vec3f axis;
+	double cos;
 };
 
 class DeformBVHTree {
 public:
-	DeformModel		*_mdl;
-	DeformBVHNode	*_root;
-	Face **face_buffer;
+	DeformModel *_mdl;
+	std::vector<DeformBVHNode> _nodes;
+	std::vector<BOX> _boxes;
+	std::vector<char> _active;
+	// A subtree whose normals lie in an open hemisphere and whose boundary
+	// projects to a simple closed curve on the plane normal to the cone axis
+	// is an embedded height field, and cannot intersect itself. _contours
+	// holds the subtree's boundary edges when they form a single loop.
+	std::vector<NormalCone> _cones;
+	std::vector< std::vector<int> > _contours;
+	std::vector<char> _selfFree;
 
     bool _ccd;
 
 public:
 	DeformBVHTree(DeformModel &, bool);
-	~DeformBVHTree();
 
 	void Construct();
 
 	float refit();
 
-	void do_task_1();
-	void do_task_2();
-
 	BOX box();
-	FORCEINLINE DeformBVHNode *getRoot() { return _root; }
 
-friend class DeformBVHNode;
+	FORCEINLINE bool empty() const { return _nodes.empty(); }
+	FORCEINLINE bool isLeaf(int i) const { return _nodes[i].isLeaf(); }
+	FORCEINLINE bool isRoot(int i) const { return _nodes[i].isRoot(); }
+	FORCEINLINE int getLeftChild(int i) const { return i+1; }
+	FORCEINLINE int getRightChild(int i) const { return _nodes[i]._child; }
+	FORCEINLINE int getParent(int i) const { return _nodes[i]._parent; }
+	FORCEINLINE bool isSelfFree(int i) const { return _selfFree[i]; }
+	FORCEINLINE Face *getFace(int i) const {
+		return _mdl->faces[_nodes[i].getFaceIndex()];
+	}
+
+private:
+	void build(int node, int parent, int *faces, int n,
+	           const BuildBounds *bounds, const vec3f *centers);
+	void buildContours();
+	bool contourSimple(int i) const;
 };
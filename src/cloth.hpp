@@ -27,8 +27,11 @@
 #ifndef CLOTH_HPP
 #define CLOTH_HPP
 
+#include "bsr.hpp"
 #include "dde.hpp"
 #include "mesh.hpp"
+#include "pcg.hpp"
+#include "taucs.hpp"
 
 struct Cloth {
     Mesh mesh;
@@ -46,6 +49,29 @@ struct Cloth {
         double size_min, size_max; // size limits
         double aspect_min; // aspect ratio control
     } remeshing;
+    // implicit system matrix, whose sparsity pattern is kept across
+    // timesteps until the mesh topology or the constraint couplings change
+    struct System {
+        BsrMat<Mat3x3> A;
+        std::vector< Vec<9,int> > face_slots;
+        std::vector< Vec<16,int> > edge_slots; // -1 on boundary edges
+        // faces and bending edges grouped so that no two in a group share
+        // a node, for parallel assembly
+        std::vector< std::vector<int> > face_colors, edge_colors;
+        struct Stencil {
+            int n; // number of nodes in the constraint gradient
+            const Node *nodes[4];
+            int ix[4]; // node indices, -1 if not in this mesh
+            int slots[4][4];
+        };
+        std::vector<Stencil> con_stencils;
+        enum Method {Taucs, Pcg} method; // linear solver to use
+        TaucsSolver taucs; // reuses its ordering while the pattern is fixed
+        PcgSolver pcg;
+        std::vector<Vec3> dv; // previous solution, to warm-start pcg
+        int topology_version;
+        System (): method(Taucs), topology_version(-1) {}
+    } system;
 };
 
 void compute_masses (Cloth &cloth);
@@ -28,6 +28,7 @@
 
 #include "collisionutil.hpp"
 #include "geometry.hpp"
+#include "instance.hpp"
 #include "magic.hpp"
 #include "optimization.hpp"
 #include "simulation.hpp"
@@ -35,6 +36,7 @@
 #include <algorithm>
 #include <fstream>
 #include <omp.h>
+#include <unordered_set>
 using namespace std;
 
 static const int max_iter = 100;
@@ -46,6 +48,14 @@ static bool deform_obstacles;
 static vector<Vec3> xold;
 static vector<Vec3> xold_obs;
 
+struct ImpactZone;
+
+// impact zones' nodes form a union-find forest over node_id()s, with -1 for
+// nodes in no zone, and the zone of each root
+static vector<int> node_offsets;
+static vector<int> zone_parent;
+static vector<ImpactZone*> root_zone;
+
 double get_mass (const Node *node) {return is_free(node) ? node->m : obs_mass;}
 
 // returns pair of (i) is_free(vert), and
@@ -78,8 +88,16 @@ struct ImpactZone {
     vector<Node*> nodes;
     vector<Impact> impacts;
     bool active;
+    int root, index; // root of its set of nodes, and position in zones
 };
 
+// Faces adjacent to active zones are active, and so are nodes and edges
+// of active faces. A node or edge pair is only tested if one is active, as
+// if through any pair of their faces with one active, but from their
+// owners, which are marked active in the hierarchies as well.
+static bool all_active;
+static unordered_set<const Node*> zone_nodes, near_nodes;
+
 void update_active (const vector<AccelStruct*> &accs,
                     const vector<AccelStruct*> &obs_accs,
                     const vector<ImpactZone*> &zones);
@@ -92,27 +110,49 @@ void add_impacts (const vector<Impact> &impacts, vector<ImpactZone*> &zones);
 
 void apply_inelastic_projection (ImpactZone *zone,
                                  const vector<Constraint*> &cons);
+void apply_inelastic_projections (const vector<ImpactZone*> &zones,
+                                  const vector<Constraint*> &cons);
 
 vector<Constraint> impact_constraints (const vector<ImpactZone*> &zones);
 
 ostream &operator<< (ostream &out, const Impact &imp);
 ostream &operator<< (ostream &out, const ImpactZone *zone);
 
-void collision_response (vector<Mesh*> &meshes, const vector<Constraint*> &cons,
-                         const vector<Mesh*> &obs_meshes) {
+int collision_response (vector<Mesh*> &meshes, const vector<Constraint*> &cons,
+                        const vector<Mesh*> &obs_meshes,
+                        AccelCache &accel_cache, bool exit_on_failure) {
     ::meshes = &meshes;
     ::obs_meshes = &obs_meshes;
     ::xold = node_positions(meshes);
-    ::xold_obs = node_positions(obs_meshes);
-    vector<AccelStruct*> accs = create_accel_structs(meshes, true),
-                         obs_accs = create_accel_structs(obs_meshes, true);
+    vector<AccelStruct*> accs = accel_cache.get(meshes, true),
+                         obs_accs = accel_cache.get(obs_meshes, true);
     vector<ImpactZone*> zones;
+    ::all_active = true;
+    ::node_offsets.assign(1, 0);
+    for (int m = 0; m < meshes.size(); m++)
+        ::node_offsets.push_back(::node_offsets.back()
+                                 + meshes[m]->nodes.size());
+    for (int o = 0; o < obs_meshes.size(); o++)
+        ::node_offsets.push_back(::node_offsets.back()
+                                 + obs_meshes[o]->nodes.size());
     ::obs_mass = 1e3;
-    int iter;
+    int iter, total_iter = 0;
     for (int deform = 0; deform <= 1; deform++) {
         ::deform_obstacles = deform;
+        if (deform_obstacles) {
+            // obstacle nodes move from here on, which instances can't follow
+            for (int o = 0; o < obs_accs.size(); o++)
+                if (obs_accs[o]->instance)
+                    obs_accs[o]->instance->detach();
+            obs_accs = accel_cache.get(obs_meshes, true);
+            ::xold_obs = node_positions(obs_meshes);
+        }
+        for (int z = 0; z < zones.size(); z++)
+            delete zones[z];
         zones.clear();
-        for (iter = 0; iter < max_iter; iter++) {
+        ::zone_parent.assign(::node_offsets.back(), -1);
+        ::root_zone.assign(::node_offsets.back(), NULL);
+        for (iter = 0; iter < max_iter; iter++, total_iter++) {
             if (!zones.empty())
                 update_active(accs, obs_accs, zones);
             vector<Impact> impacts = find_impacts(accs, obs_accs);
@@ -120,10 +160,7 @@ void collision_response (vector<Mesh*> &meshes, const vector<Constraint*> &cons,
             if (impacts.empty())
                 break;
             add_impacts(impacts, zones);
-            for (int z = 0; z < zones.size(); z++) {
-                ImpactZone *zone = zones[z];
-                apply_inelastic_projection(zone, cons);
-            }
+            apply_inelastic_projections(zones, cons);
             for (int a = 0; a < accs.size(); a++)
                 update_accel_struct(*accs[a]);
             for (int a = 0; a < obs_accs.size(); a++)
@@ -134,24 +171,32 @@ void collision_response (vector<Mesh*> &meshes, const vector<Constraint*> &cons,
         if (iter < max_iter) // success!
             break;
     }
-    if (iter == max_iter) {
+    if (iter == max_iter && exit_on_failure) {
         cerr << "Collision resolution failed to converge!" << endl;
+        for (int o = 0; o < obs_accs.size(); o++)
+            if (obs_accs[o]->instance)
+                obs_accs[o]->instance->update_all();
         debug_save_meshes(meshes, "meshes");
         debug_save_meshes(obs_meshes, "obsmeshes");
         exit(1);
     }
+    if (iter == max_iter)
+        total_iter = -1;
     for (int m = 0; m < meshes.size(); m++) {
         compute_ws_data(*meshes[m]);
         update_x0(*meshes[m]);
     }
     for (int o = 0; o < obs_meshes.size(); o++) {
+        if (obs_accs[o]->instance) {
+            obs_accs[o]->instance->update_x0();
+            continue;
+        }
         compute_ws_data(*obs_meshes[o]);
         update_x0(*obs_meshes[o]);
     }
     for (int z = 0; z < zones.size(); z++)
         delete zones[z];
-    destroy_accel_structs(accs);
-    destroy_accel_structs(obs_accs);
+    return total_iter;
 }
 
 void update_active (const vector<AccelStruct*> &accs,
@@ -161,107 +206,220 @@ void update_active (const vector<AccelStruct*> &accs,
         mark_all_inactive(*accs[a]);
     for (int a = 0; a < obs_accs.size(); a++)
         mark_all_inactive(*obs_accs[a]);
+    ::all_active = false;
+    ::zone_nodes.clear();
+    ::near_nodes.clear();
     for (int z = 0; z < zones.size(); z++) {
         const ImpactZone *zone = zones[z];
-        if (!zone->active)
-            continue;
-        for (int n = 0; n < zone->nodes.size(); n++) {
-            const Node *node = zone->nodes[n];
-            pair<bool,int> mi = find_in_meshes(node);
-            AccelStruct *acc = (mi.first ? accs : obs_accs)[mi.second];
-            for (int v = 0; v < node->verts.size(); v++)
-                for (int f = 0; f < node->verts[v]->adjf.size(); f++)
-                    mark_active(*acc, node->verts[v]->adjf[f]);
-        }
+        if (zone->active)
+            ::zone_nodes.insert(zone->nodes.begin(), zone->nodes.end());
+    }
+    for (unordered_set<const Node*>::iterator it = ::zone_nodes.begin();
+         it != ::zone_nodes.end(); it++) {
+        const Node *node = *it;
+        pair<bool,int> mi = find_in_meshes(node);
+        AccelStruct *acc = (mi.first ? accs : obs_accs)[mi.second];
+        for (int v = 0; v < node->verts.size(); v++)
+            for (int f = 0; f < node->verts[v]->adjf.size(); f++) {
+                const Face *face = node->verts[v]->adjf[f];
+                mark_active(*acc, face);
+                for (int i = 0; i < 3; i++) {
+                    ::near_nodes.insert(face->v[i]->node);
+                    mark_active(*acc, owner(face->v[i]->node));
+                    mark_active(*acc, owner(face->adje[i]));
+                }
+            }
     }
 }
 
+static bool is_active (const Face *face) {
+    if (!face)
+        return false;
+    for (int v = 0; v < 3; v++)
+        if (::zone_nodes.count(face->v[v]->node))
+            return true;
+    return false;
+}
+
+static bool is_active (const Node *node) {
+    return ::near_nodes.count(node);
+}
+
+static bool is_active (const Edge *edge) {
+    return is_active(edge->adjf[0]) || is_active(edge->adjf[1]);
+}
+
 // Impacts
 
+// Impacts are found in two phases. Traversing the hierarchies collects
+// node-face and edge-edge candidates whose boxes overlap into per-thread
+// lists, and the candidates are then tested in parallel batches, computing
+// the cubics of a whole batch and filtering them before finding roots.
+
+struct Candidate {
+    Impact::Type type;
+    const Node *nodes[4];
+};
+
+static const int batch_size = 64;
+
 static int nthreads = 0;
+static vector<Candidate> *candidates = NULL;
 static vector<Impact> *impacts = NULL;
 
 void find_face_impacts (const Face *face0, const Face *face1);
 
+void test_candidates (const Candidate *cands, int n, vector<Impact> &impacts);
+
 vector<Impact> find_impacts (const vector<AccelStruct*> &accs,
                              const vector<AccelStruct*> &obs_accs) {
     if (!impacts) {
         ::nthreads = omp_get_max_threads();
+        ::candidates = new vector<Candidate>[::nthreads];
         ::impacts = new vector<Impact>[::nthreads];
     }
-    for (int t = 0; t < ::nthreads; t++)
+    for (int t = 0; t < ::nthreads; t++) {
+        ::candidates[t].clear();
         ::impacts[t].clear();
-    for_overlapping_faces(accs, obs_accs, ::thickness, find_face_impacts);
+    }
+    for_overlapping_faces(accs, obs_accs, ::thickness, find_face_impacts, true);
+    vector<Candidate> cands;
+    for (int t = 0; t < ::nthreads; t++)
+        append(cands, ::candidates[t]);
+    int nbatches = (cands.size() + batch_size - 1)/batch_size;
+    // static schedule, so concatenating keeps the candidates' order
+#pragma omp parallel for schedule(static)
+    for (int b = 0; b < nbatches; b++)
+        test_candidates(&cands[b*batch_size],
+                        min(batch_size, (int)cands.size() - b*batch_size),
+                        ::impacts[omp_get_thread_num()]);
     vector<Impact> impacts;
     for (int t = 0; t < ::nthreads; t++)
         append(impacts, ::impacts[t]);
     return impacts;
 }
 
-bool vf_collision_test (const Vert *vert, const Face *face, Impact &impact);
-bool ee_collision_test (const Edge *edge0, const Edge *edge1, Impact &impact);
+bool vf_candidate (const Vert *vert, const Face *face, Candidate &cand);
+bool ee_candidate (const Edge *edge0, const Edge *edge1, Candidate &cand);
 
 void find_face_impacts (const Face *face0, const Face *face1) {
-    int t = omp_get_thread_num();
-    Impact impact;
+    vector<Candidate> &cands = ::candidates[omp_get_thread_num()];
+    Candidate cand;
     for (int v = 0; v < 3; v++)
-        if (vf_collision_test(face0->v[v], face1, impact))
-            ::impacts[t].push_back(impact);
+        if (owner(face0->v[v]->node) == face0
+            && vf_candidate(face0->v[v], face1, cand))
+            cands.push_back(cand);
     for (int v = 0; v < 3; v++)
-        if (vf_collision_test(face1->v[v], face0, impact))
-            ::impacts[t].push_back(impact);
+        if (owner(face1->v[v]->node) == face1
+            && vf_candidate(face1->v[v], face0, cand))
+            cands.push_back(cand);
     for (int e0 = 0; e0 < 3; e0++)
-        for (int e1 = 0; e1 < 3; e1++)
-            if (ee_collision_test(face0->adje[e0], face1->adje[e1], impact))
-                ::impacts[t].push_back(impact);
+        if (owner(face0->adje[e0]) == face0)
+            for (int e1 = 0; e1 < 3; e1++)
+                if (owner(face1->adje[e1]) == face1
+                    && ee_candidate(face0->adje[e0], face1->adje[e1], cand))
+                    cands.push_back(cand);
 }
 
-bool collision_test (Impact::Type type, const Node *node0, const Node *node1,
-                     const Node *node2, const Node *node3, Impact &impact);
-
-bool vf_collision_test (const Vert *vert, const Face *face, Impact &impact) {
+bool vf_candidate (const Vert *vert, const Face *face, Candidate &cand) {
     const Node *node = vert->node;
     if (node == face->v[0]->node
      || node == face->v[1]->node
      || node == face->v[2]->node)
         return false;
+    if (!::all_active && !is_active(node) && !is_active(face))
+        return false;
     if (!overlap(node_box(node, true), face_box(face, true), ::thickness))
         return false;
-    return collision_test(Impact::VF, node, face->v[0]->node, face->v[1]->node,
-                          face->v[2]->node, impact);
+    cand.type = Impact::VF;
+    cand.nodes[0] = node;
+    for (int v = 0; v < 3; v++)
+        cand.nodes[v+1] = face->v[v]->node;
+    return true;
 }
 
-bool ee_collision_test (const Edge *edge0, const Edge *edge1, Impact &impact) {
+bool ee_candidate (const Edge *edge0, const Edge *edge1, Candidate &cand) {
     if (edge0->n[0] == edge1->n[0] || edge0->n[0] == edge1->n[1]
         || edge0->n[1] == edge1->n[0] || edge0->n[1] == edge1->n[1])
         return false;
+    if (!::all_active && !is_active(edge0) && !is_active(edge1))
+        return false;
     if (!overlap(edge_box(edge0, true), edge_box(edge1, true), ::thickness))
         return false;
-    return collision_test(Impact::EE, edge0->n[0], edge0->n[1],
-                          edge1->n[0], edge1->n[1], impact);
+    cand.type = Impact::EE;
+    for (int n = 0; n < 2; n++) {
+        cand.nodes[n] = edge0->n[n];
+        cand.nodes[n+2] = edge1->n[n];
+    }
+    return true;
+}
+
+bool coplanarity_cubic (const Candidate &cand, double a[4]);
+
+bool collision_test (const Candidate &cand, const double a[4],
+                     Impact &impact);
+
+void test_candidates (const Candidate *cands, int n, vector<Impact> &impacts) {
+    double a[batch_size][4];
+    bool possible[batch_size];
+    for (int c = 0; c < n; c++)
+        possible[c] = coplanarity_cubic(cands[c], a[c]);
+    Impact impact;
+    for (int c = 0; c < n; c++)
+        if (possible[c] && collision_test(cands[c], a[c], impact))
+            impacts.push_back(impact);
+}
+
+static double max_length (const Node *node0, const Node *node1) {
+    return max(norm(node1->x0 - node0->x0), norm(node1->x - node0->x));
+}
+
+// Computes the coefficients of the cubic in t that vanishes when the nodes
+// are coplanar. At any time, the contact distance tested is its value over
+// the norm of a cross product of two edges, so if its Bernstein coefficients
+// bound it away from zero on [0,1], the nodes never get close enough.
+bool coplanarity_cubic (const Candidate &cand, double a[4]) {
+    const Node *const *nodes = cand.nodes;
+    const Vec3 &x0 = nodes[0]->x0, v0 = nodes[0]->x - x0;
+    Vec3 x1 = nodes[1]->x0 - x0, x2 = nodes[2]->x0 - x0,
+         x3 = nodes[3]->x0 - x0;
+    Vec3 v1 = (nodes[1]->x - nodes[1]->x0) - v0,
+         v2 = (nodes[2]->x - nodes[2]->x0) - v0,
+         v3 = (nodes[3]->x - nodes[3]->x0) - v0;
+    a[0] = stp(x1, x2, x3);
+    a[1] = stp(v1, x2, x3) + stp(x1, v2, x3) + stp(x1, x2, v3);
+    a[2] = stp(x1, v2, v3) + stp(v1, x2, v3) + stp(v1, v2, x3);
+    a[3] = stp(v1, v2, v3);
+    double b[4] = {a[0], a[0] + a[1]/3, a[0] + (2*a[1] + a[2])/3,
+                   a[0] + a[1] + a[2] + a[3]};
+    double bmin = min(b[0], b[1], b[2], b[3]),
+           bmax = max(b[0], b[1], b[2], b[3]);
+    double cross_max = (cand.type == Impact::VF)
+        ? max_length(nodes[1], nodes[2])*max_length(nodes[1], nodes[3])
+        : max_length(nodes[0], nodes[1])*max_length(nodes[2], nodes[3]);
+    double bound = 2e-6*cross_max; // with a safety factor
+    return !(bmin > bound || bmax < -bound);
 }
 
 int solve_cubic (double a3, double a2, double a1, double a0, double t[3]);
 
 Vec3 pos (const Node *node, double t);
 
-bool collision_test (Impact::Type type, const Node *node0, const Node *node1,
-                     const Node *node2, const Node *node3, Impact &impact) {
+bool collision_test (const Candidate &cand, const double a[4],
+                     Impact &impact) {
+    Impact::Type type = cand.type;
+    const Node *node0 = cand.nodes[0], *node1 = cand.nodes[1],
+               *node2 = cand.nodes[2], *node3 = cand.nodes[3];
     impact.type = type;
     impact.nodes[0] = (Node*)node0;
     impact.nodes[1] = (Node*)node1;
     impact.nodes[2] = (Node*)node2;
     impact.nodes[3] = (Node*)node3;
-    const Vec3 &x0 = node0->x0, v0 = node0->x - x0;
-    Vec3 x1 = node1->x0 - x0, x2 = node2->x0 - x0, x3 = node3->x0 - x0;
+    Vec3 v0 = node0->x - node0->x0;
     Vec3 v1 = (node1->x - node1->x0) - v0, v2 = (node2->x - node2->x0) - v0,
          v3 = (node3->x - node3->x0) - v0;
-    double a0 = stp(x1, x2, x3),
-           a1 = stp(v1, x2, x3) + stp(x1, v2, x3) + stp(x1, x2, v3),
-           a2 = stp(x1, v2, v3) + stp(v1, x2, v3) + stp(v1, v2, x3),
-           a3 = stp(v1, v2, v3);
     double t[4];
-    int nsol = solve_cubic(a3, a2, a1, a0, t);
+    int nsol = solve_cubic(a[3], a[2], a[1], a[0], t);
     t[nsol] = 1; // also check at end of timestep
     for (int i = 0; i < nsol; i++) {
         if (t[i] < 0 || t[i] > 1)
@@ -379,6 +537,21 @@ ImpactZone *find_or_create_zone (const Node *node, vector<ImpactZone*> &zones);
 void merge_zones (ImpactZone* zone0, ImpactZone *zone1,
                   vector<ImpactZone*> &zones);
 
+// Index of a node among those of all cloth meshes, then all obstacle meshes
+int node_id (const Node *node) {
+    pair<bool,int> mi = find_in_meshes(node);
+    int m = mi.first ? mi.second : ::meshes->size() + mi.second;
+    return ::node_offsets[m] + node->index;
+}
+
+int find_root (int i) {
+    while (::zone_parent[i] != i) {
+        ::zone_parent[i] = ::zone_parent[::zone_parent[i]];
+        i = ::zone_parent[i];
+    }
+    return i;
+}
+
 void add_impacts (const vector<Impact> &impacts, vector<ImpactZone*> &zones) {
     for (int z = 0; z < zones.size(); z++)
         zones[z]->active = false;
@@ -396,12 +569,16 @@ void add_impacts (const vector<Impact> &impacts, vector<ImpactZone*> &zones) {
 }
 
 ImpactZone *find_or_create_zone (const Node *node, vector<ImpactZone*> &zones) {
-    for (int z = 0; z < zones.size(); z++)
-        if (is_in((Node*)node, zones[z]->nodes))
-            return zones[z];
+    int i = node_id(node);
+    if (::zone_parent[i] != -1)
+        return ::root_zone[find_root(i)];
     ImpactZone *zone = new ImpactZone;
     zone->nodes.push_back((Node*)node);
+    zone->root = i;
+    zone->index = zones.size();
     zones.push_back(zone);
+    ::zone_parent[i] = i;
+    ::root_zone[i] = zone;
     return zone;
 }
 
@@ -409,9 +586,21 @@ void merge_zones (ImpactZone* zone0, ImpactZone *zone1,
                   vector<ImpactZone*> &zones) {
     if (zone0 == zone1)
         return;
+    // the smaller set goes under the larger, but zone0 keeps the nodes and
+    // impacts of both in order
+    if (zone0->nodes.size() >= zone1->nodes.size())
+        ::zone_parent[zone1->root] = zone0->root;
+    else {
+        ::zone_parent[zone0->root] = zone1->root;
+        zone0->root = zone1->root;
+    }
+    ::root_zone[zone0->root] = zone0;
     append(zone0->nodes, zone1->nodes);
     append(zone0->impacts, zone1->impacts);
-    exclude(zone1, zones);
+    // same as exclude(zone1, zones)
+    zones[zone1->index] = zones.back();
+    zones[zone1->index]->index = zone1->index;
+    zones.pop_back();
     delete zone1;
 }
 
@@ -420,6 +609,7 @@ void merge_zones (ImpactZone* zone0, ImpactZone *zone1,
 struct NormalOpt: public NLConOpt {
     ImpactZone *zone;
     double inv_m;
+    vector< Vec<4,int> > impact_nodes; // their indices in zone, or -1
     NormalOpt (): zone(NULL), inv_m(0) {nvar = ncon = 0;}
     NormalOpt (ImpactZone *zone): zone(zone), inv_m(0) {
         nvar = zone->nodes.size()*3;
@@ -427,6 +617,20 @@ struct NormalOpt: public NLConOpt {
         for (int n = 0; n < zone->nodes.size(); n++)
             inv_m += 1/get_mass(zone->nodes[n]);
         inv_m /= zone->nodes.size();
+        vector< pair<const Node*,int> > index(zone->nodes.size());
+        for (int n = 0; n < zone->nodes.size(); n++)
+            index[n] = make_pair(zone->nodes[n], n);
+        sort(index.begin(), index.end());
+        impact_nodes.resize(ncon);
+        for (int j = 0; j < ncon; j++)
+            for (int n = 0; n < 4; n++) {
+                const Node *node = zone->impacts[j].nodes[n];
+                vector< pair<const Node*,int> >::iterator it =
+                    lower_bound(index.begin(), index.end(),
+                                make_pair(node, 0));
+                impact_nodes[j][n] = (it != index.end() && it->first == node)
+                                   ? it->second : -1;
+            }
     }
     void initialize (double *x) const;
     void precompute (const double *x) const;
@@ -444,6 +648,23 @@ void apply_inelastic_projection (ImpactZone *zone,
     augmented_lagrangian_method(NormalOpt(zone));
 }
 
+static bool larger_zone (const ImpactZone *zone0, const ImpactZone *zone1) {
+    return zone0->nodes.size() > zone1->nodes.size();
+}
+
+// Zones share no nodes, so they are solved concurrently, largest first
+void apply_inelastic_projections (const vector<ImpactZone*> &zones,
+                                  const vector<Constraint*> &cons) {
+    vector<ImpactZone*> active;
+    for (int z = 0; z < zones.size(); z++)
+        if (zones[z]->active)
+            active.push_back(zones[z]);
+    sort(active.begin(), active.end(), larger_zone);
+#pragma omp parallel for schedule(dynamic) if (active.size() > 1)
+    for (int z = 0; z < active.size(); z++)
+        apply_inelastic_projection(active[z], cons);
+}
+
 void NormalOpt::initialize (double *x) const {
     for (int n = 0; n < zone->nodes.size(); n++)
         set_subvec(x, n, zone->nodes[n]->x);
@@ -487,7 +708,7 @@ void NormalOpt::con_grad (const double *x, int j, double factor,
                           double *grad) const {
     const Impact &impact = zone->impacts[j];
     for (int n = 0; n < 4; n++) {
-        int i = find(impact.nodes[n], zone->nodes);
+        int i = impact_nodes[j][n];
         if (i != -1)
             add_subvec(grad, i, factor*impact.w[n]*impact.n);
     }
@@ -27,11 +27,15 @@
 #ifndef COLLISION_HPP
 #define COLLISION_HPP
 
+#include "accelcache.hpp"
 #include "cloth.hpp"
 #include "constraint.hpp"
 
-void collision_response (std::vector<Mesh*> &meshes,
-                         const std::vector<Constraint*> &cons,
-                         const std::vector<Mesh*> &obs_meshes);
+// returns the number of impact zone iterations taken; if they fail to
+// converge, exits, or returns -1 leaving the meshes in an intermediate state
+int collision_response (std::vector<Mesh*> &meshes,
+                        const std::vector<Constraint*> &cons,
+                        const std::vector<Mesh*> &obs_meshes,
+                        AccelCache &accel_cache, bool exit_on_failure=true);
 
 #endif
@@ -26,151 +26,298 @@
 
 #include "collisionutil.hpp"
 
+#include "instance.hpp"
 #include "simulation.hpp"
 #include <omp.h>
 using namespace std;
 
-void collect_leaves (BVHNode *node, vector<BVHNode*> &leaves);
-
-AccelStruct::AccelStruct (const Mesh &mesh, bool ccd):
-    tree((Mesh&)mesh, ccd), root(tree._root), leaves(mesh.faces.size()) {
-    if (root)
-        collect_leaves(root, leaves);
-}
-
-void collect_leaves (BVHNode *node, vector<BVHNode*> &leaves) {
-    if (node->isLeaf()) {
-        int f = node->getFace()->index;
-        if (f >= leaves.size())
-            leaves.resize(f+1);
-        leaves[f] = node;
-    } else {
-        collect_leaves(node->getLeftChild(), leaves);
-        collect_leaves(node->getRightChild(), leaves);
-    }
+AccelStruct::AccelStruct (const Mesh &mesh, bool ccd,
+                          RigidInstance *instance):
+    tree((Mesh&)mesh, ccd), root(tree.empty() ? -1 : 0),
+    leaves(mesh.faces.size()), refits(0), instance(instance) {
+    for (int n = 0; n < tree._nodes.size(); n++)
+        if (tree.isLeaf(n))
+            leaves[tree._nodes[n].getFaceIndex()] = n;
 }
 
 void update_accel_struct (AccelStruct &acc) {
-    if (acc.root)
+    if (acc.instance)
+        return; // the base mesh doesn't move
+    if (acc.root >= 0)
         acc.tree.refit();
+    acc.refits++;
 }
 
-void mark_descendants (BVHNode *node, bool active);
-void mark_ancestors (BVHNode *node, bool active);
+void mark_all_active (AccelStruct &acc) {
+    fill(acc.tree._active.begin(), acc.tree._active.end(), true);
+}
 
 void mark_all_inactive (AccelStruct &acc) {
-    if (acc.root)
-        mark_descendants(acc.root, false);
+    fill(acc.tree._active.begin(), acc.tree._active.end(), false);
 }
 
 void mark_active (AccelStruct &acc, const Face *face) {
-    if (acc.root)
-        mark_ancestors(acc.leaves[face->index], true);
+    if (acc.root < 0)
+        return;
+    for (int n = acc.leaves[face->index]; n >= 0; n = acc.tree.getParent(n))
+        acc.tree._active[n] = true;
 }
 
-void mark_descendants (BVHNode *node, bool active) {
-    node->_active = active;
-    if (!node->isLeaf()) {
-        mark_descendants(node->_left, active);
-        mark_descendants(node->_right, active);
+void for_overlapping_faces (const BVHTree &tree, int node, float thickness,
+                            BVHCallback callback, bool intersecting) {
+    if (tree.isLeaf(node) || !tree._active[node]
+        || (intersecting && tree.isSelfFree(node)))
+        return;
+    int left = tree.getLeftChild(node), right = tree.getRightChild(node);
+    for_overlapping_faces(tree, left, thickness, callback, intersecting);
+    for_overlapping_faces(tree, right, thickness, callback, intersecting);
+    for_overlapping_faces(tree, left, tree, right, thickness, callback);
+}
+
+void for_overlapping_faces (const BVHTree &tree0, int node0,
+                            const BVHTree &tree1, int node1, float thickness,
+                            BVHCallback callback) {
+    if (!tree0._active[node0] && !tree1._active[node1])
+        return;
+    if (!overlap(tree0._boxes[node0], tree1._boxes[node1], thickness))
+        return;
+    if (tree0.isLeaf(node0) && tree1.isLeaf(node1)) {
+        callback(tree0.getFace(node0), tree1.getFace(node1));
+    } else if (tree0.isLeaf(node0)) {
+        for_overlapping_faces(tree0, node0, tree1, tree1.getLeftChild(node1),
+                              thickness, callback);
+        for_overlapping_faces(tree0, node0, tree1, tree1.getRightChild(node1),
+                              thickness, callback);
+    } else {
+        for_overlapping_faces(tree0, tree0.getLeftChild(node0), tree1, node1,
+                              thickness, callback);
+        for_overlapping_faces(tree0, tree0.getRightChild(node0), tree1, node1,
+                              thickness, callback);
     }
 }
 
-void mark_ancestors (BVHNode *node, bool active) {
-    node->_active = active;
-    if (!node->isRoot())
-        mark_ancestors(node->_parent, active);
+// A hierarchy is traversed against an instance's with its boxes mapped into
+// the instance's base frame on the way down. The face pairs found are kept
+// per thread, and only passed to the callback once the instance's faces
+// among them have been brought up to date.
+
+struct InstancePair {
+    const Face *face0, *face1;
+    RigidInstance *instance;
+};
+
+static vector<InstancePair> *instance_pairs = NULL;
+
+static void for_overlapping_faces (const BVHTree &tree0, int node0,
+                                   const BOX &box0, const AccelStruct &acc1,
+                                   int node1, float thickness) {
+    const BVHTree &tree1 = acc1.tree;
+    if (!tree0._active[node0] && !tree1._active[node1])
+        return;
+    if (!overlap(box0, tree1._boxes[node1], thickness))
+        return;
+    if (tree0.isLeaf(node0) && tree1.isLeaf(node1)) {
+        int f = tree1._nodes[node1].getFaceIndex();
+        InstancePair pair = {tree0.getFace(node0),
+                             acc1.instance->mesh->faces[f], acc1.instance};
+        ::instance_pairs[omp_get_thread_num()].push_back(pair);
+    } else if (tree0.isLeaf(node0)) {
+        for_overlapping_faces(tree0, node0, box0, acc1,
+                              tree1.getLeftChild(node1), thickness);
+        for_overlapping_faces(tree0, node0, box0, acc1,
+                              tree1.getRightChild(node1), thickness);
+    } else {
+        int left = tree0.getLeftChild(node0),
+            right = tree0.getRightChild(node0);
+        const RigidInstance *instance = acc1.instance;
+        for_overlapping_faces(tree0, left,
+                              instance->to_base(tree0._boxes[left], tree0._ccd),
+                              acc1, node1, thickness);
+        for_overlapping_faces(tree0, right,
+                              instance->to_base(tree0._boxes[right],
+                                                tree0._ccd),
+                              acc1, node1, thickness);
+    }
 }
 
-void for_overlapping_faces (BVHNode *node, float thickness,
-                            BVHCallback callback) {
-	if (node->isLeaf() || !node->_active)
-		return;
-	for_overlapping_faces(node->getLeftChild(), thickness, callback);
-	for_overlapping_faces(node->getRightChild(), thickness, callback);
-	for_overlapping_faces(node->getLeftChild(), node->getRightChild(),
-                          thickness, callback);
+static void call_instance_pairs (BVHCallback callback, bool parallel) {
+    vector<InstancePair> pairs;
+    for (int t = 0; t < omp_get_max_threads(); t++) {
+        append(pairs, ::instance_pairs[t]);
+        ::instance_pairs[t].clear();
+    }
+    vector<RigidInstance*> instances;
+    vector< vector<const Face*> > faces;
+    for (int p = 0; p < pairs.size(); p++) {
+        int i = find(pairs[p].instance, instances);
+        if (i == -1) {
+            i = instances.size();
+            instances.push_back(pairs[p].instance);
+            faces.push_back(vector<const Face*>());
+        }
+        faces[i].push_back(pairs[p].face1);
+    }
+    for (int i = 0; i < instances.size(); i++)
+        instances[i]->update(faces[i]);
+#pragma omp parallel for if (parallel)
+    for (int p = 0; p < pairs.size(); p++)
+        callback(pairs[p].face0, pairs[p].face1);
 }
 
-void for_overlapping_faces (BVHNode *node0, BVHNode *node1, float thickness,
-                            BVHCallback callback) {
-    if (!node0->_active && !node1->_active)
+// Parallel traversal spawns a task for each pair of subtrees to be visited,
+// down to subtrees of about task_faces faces, and leaves the scheduling to
+// the OpenMP runtime. A subtree rooted at node spans the nodes up to end.
+
+static const int task_faces = 256;
+
+static int nfaces (int node, int end) {
+    return (end - node + 1)/2;
+}
+
+// (tasks take the trees by pointer, as references would be privatized)
+static void traverse (const BVHTree *tree0, int node0, int end0,
+                      const BVHTree *tree1, int node1, int end1,
+                      float thickness, BVHCallback callback) {
+    if (min(nfaces(node0, end0), nfaces(node1, end1)) <= task_faces) {
+        for_overlapping_faces(*tree0, node0, *tree1, node1, thickness,
+                              callback);
+        return;
+    }
+    if (!tree0->_active[node0] && !tree1->_active[node1])
+        return;
+    if (!overlap(tree0->_boxes[node0], tree1->_boxes[node1], thickness))
+        return;
+    if (nfaces(node1, end1) > nfaces(node0, end0)) {
+        int left = tree1->getLeftChild(node1),
+            right = tree1->getRightChild(node1);
+#pragma omp task
+        traverse(tree0, node0, end0, tree1, left, right, thickness, callback);
+        traverse(tree0, node0, end0, tree1, right, end1, thickness, callback);
+    } else {
+        int left = tree0->getLeftChild(node0),
+            right = tree0->getRightChild(node0);
+#pragma omp task
+        traverse(tree0, left, right, tree1, node1, end1, thickness, callback);
+        traverse(tree0, right, end0, tree1, node1, end1, thickness, callback);
+    }
+}
+
+static void traverse (const BVHTree *tree0, int node0, int end0, BOX box0,
+                      const AccelStruct *acc1, int node1, int end1,
+                      float thickness) {
+    if (min(nfaces(node0, end0), nfaces(node1, end1)) <= task_faces) {
+        for_overlapping_faces(*tree0, node0, box0, *acc1, node1, thickness);
+        return;
+    }
+    const BVHTree *tree1 = &acc1->tree;
+    if (!tree0->_active[node0] && !tree1->_active[node1])
         return;
-    if (!overlap(node0->_box, node1->_box, thickness))
+    if (!overlap(box0, tree1->_boxes[node1], thickness))
         return;
-    if (node0->isLeaf() && node1->isLeaf()) {
-        Face *face0 = node0->getFace(),
-             *face1 = node1->getFace();
-        callback(face0, face1);
-    } else if (node0->isLeaf()) {
-        for_overlapping_faces(node0, node1->getLeftChild(), thickness,callback);
-        for_overlapping_faces(node0, node1->getRightChild(),thickness,callback);
+    if (nfaces(node1, end1) > nfaces(node0, end0)) {
+        int left = tree1->getLeftChild(node1),
+            right = tree1->getRightChild(node1);
+#pragma omp task
+        traverse(tree0, node0, end0, box0, acc1, left, right, thickness);
+        traverse(tree0, node0, end0, box0, acc1, right, end1, thickness);
     } else {
-        for_overlapping_faces(node0->getLeftChild(), node1, thickness,callback);
-        for_overlapping_faces(node0->getRightChild(), node1,thickness,callback);
+        int left = tree0->getLeftChild(node0),
+            right = tree0->getRightChild(node0);
+        const RigidInstance *instance = acc1->instance;
+        BOX left_box = instance->to_base(tree0->_boxes[left], tree0->_ccd),
+            right_box = instance->to_base(tree0->_boxes[right], tree0->_ccd);
+#pragma omp task
+        traverse(tree0, left, right, left_box, acc1, node1, end1, thickness);
+        traverse(tree0, right, end0, right_box, acc1, node1, end1, thickness);
+    }
+}
+
+static void traverse (const BVHTree *tree, int node, int end, float thickness,
+                      BVHCallback callback, bool intersecting) {
+    if (nfaces(node, end) <= task_faces) {
+        for_overlapping_faces(*tree, node, thickness, callback, intersecting);
+        return;
+    }
+    if (!tree->_active[node] || (intersecting && tree->isSelfFree(node)))
+        return;
+    int left = tree->getLeftChild(node), right = tree->getRightChild(node);
+#pragma omp task
+    traverse(tree, left, right, thickness, callback, intersecting);
+#pragma omp task
+    traverse(tree, right, end, thickness, callback, intersecting);
+    traverse(tree, left, right, tree, right, end, thickness, callback);
+}
+
+static void traverse (const AccelStruct *acc, float thickness,
+                      BVHCallback callback, bool intersecting) {
+    traverse(&acc->tree, acc->root, acc->tree._nodes.size(), thickness,
+             callback, intersecting);
+}
+
+static void traverse (const AccelStruct *acc0, const AccelStruct *acc1,
+                      float thickness, BVHCallback callback) {
+    if (acc1->instance) {
+        const RigidInstance *instance = acc1->instance;
+        const BVHTree &tree0 = acc0->tree;
+        traverse(&tree0, acc0->root, tree0._nodes.size(),
+                 instance->to_base(tree0._boxes[acc0->root], tree0._ccd),
+                 acc1, acc1->root, acc1->tree._nodes.size(),
+                 thickness/instance->pose.trans.scale);
+        return;
     }
+    traverse(&acc0->tree, acc0->root, acc0->tree._nodes.size(),
+             &acc1->tree, acc1->root, acc1->tree._nodes.size(),
+             thickness, callback);
 }
 
-vector<BVHNode*> collect_upper_nodes (const vector<AccelStruct*> &accs, int n);
+static void init_instance_pairs () {
+    if (!::instance_pairs)
+        ::instance_pairs = new vector<InstancePair>[omp_get_max_threads()];
+}
 
 void for_overlapping_faces (const vector<AccelStruct*> &accs,
                             const vector<AccelStruct*> &obs_accs,
                             double thickness, BVHCallback callback,
-                            bool parallel) {
-    int nnodes = (int)ceil(sqrt(2*omp_get_max_threads()));
-    vector<BVHNode*> nodes = collect_upper_nodes(accs, nnodes);
-    int nthreads = omp_get_max_threads();
-    omp_set_num_threads(parallel ? omp_get_max_threads() : 1);
-#pragma omp parallel for
-    for (int n = 0; n < nodes.size(); n++) {
-        for_overlapping_faces(nodes[n], thickness, callback);
-        for (int m = 0; m < n; m++)
-            for_overlapping_faces(nodes[n], nodes[m], thickness, callback);
+                            bool intersecting, bool parallel) {
+    init_instance_pairs();
+#pragma omp parallel if (parallel)
+#pragma omp single
+    for (int a = 0; a < accs.size(); a++) {
+        if (accs[a]->root < 0)
+            continue;
+#pragma omp task
+        traverse(accs[a], thickness, callback, intersecting);
+        for (int b = 0; b < a; b++)
+            if (accs[b]->root >= 0) {
+#pragma omp task
+                traverse(accs[a], accs[b], thickness, callback);
+            }
         for (int o = 0; o < obs_accs.size(); o++)
-            if (obs_accs[o]->root)
-                for_overlapping_faces(nodes[n], obs_accs[o]->root, thickness,
-                                      callback);
+            if (obs_accs[o]->root >= 0) {
+#pragma omp task
+                traverse(accs[a], obs_accs[o], thickness, callback);
+            }
     }
-    omp_set_num_threads(nthreads);
+    call_instance_pairs(callback, parallel);
 }
 
 void for_faces_overlapping_obstacles (const vector<AccelStruct*> &accs,
                                       const vector<AccelStruct*> &obs_accs,
                                       double thickness, BVHCallback callback,
                                       bool parallel) {
-    int nnodes = omp_get_max_threads();
-    vector<BVHNode*> nodes = collect_upper_nodes(accs, nnodes);
-    int nthreads = omp_get_max_threads();
-    omp_set_num_threads(parallel ? omp_get_max_threads() : 1);
-#pragma omp parallel for
-    for (int n = 0; n < nodes.size(); n++)
+    init_instance_pairs();
+#pragma omp parallel if (parallel)
+#pragma omp single
+    for (int a = 0; a < accs.size(); a++) {
+        if (accs[a]->root < 0)
+            continue;
         for (int o = 0; o < obs_accs.size(); o++)
-            if (obs_accs[o]->root)
-                for_overlapping_faces(nodes[n], obs_accs[o]->root, thickness,
-                                      callback);
-    omp_set_num_threads(nthreads);
-}
-
-vector<BVHNode*> collect_upper_nodes (const vector<AccelStruct*> &accs,
-                                      int nnodes) {
-    vector<BVHNode*> nodes;
-    for (int a = 0; a < accs.size(); a++)
-        if (accs[a]->root)
-            nodes.push_back(accs[a]->root);
-    while (nodes.size() < nnodes) {
-        vector<BVHNode*> children;
-        for (int n = 0; n < nodes.size(); n++)
-            if (nodes[n]->isLeaf())
-                children.push_back(nodes[n]);
-            else {
-                children.push_back(nodes[n]->_left);
-                children.push_back(nodes[n]->_right);
+            if (obs_accs[o]->root >= 0) {
+#pragma omp task
+                traverse(accs[a], obs_accs[o], thickness, callback);
             }
-        if (children.size() == nodes.size())
-            break;
-        nodes = children;
     }
-    return nodes;
+    call_instance_pairs(callback, parallel);
 }
 
 vector<AccelStruct*> create_accel_structs (const vector<Mesh*> &meshes,
@@ -32,29 +32,41 @@
 typedef DeformBVHNode BVHNode;
 typedef DeformBVHTree BVHTree;
 
+struct RigidInstance;
+
 struct AccelStruct {
     BVHTree tree;
-    BVHNode *root;
-    std::vector<BVHNode*> leaves;
-    AccelStruct (const Mesh &mesh, bool ccd);
+    int root; // -1 if the mesh is empty
+    std::vector<int> leaves; // node of each face
+    int refits; // by update_accel_struct
+    // if set, the structure is of the instance's base mesh and stands for
+    // the instance's mesh, whose faces it reports
+    RigidInstance *instance;
+    AccelStruct (const Mesh &mesh, bool ccd, RigidInstance *instance=NULL);
 };
 
 void update_accel_struct (AccelStruct &acc);
 
+void mark_all_active (AccelStruct &acc);
 void mark_all_inactive (AccelStruct &acc);
 void mark_active (AccelStruct &acc, const Face *face);
 
 // callback must be safe to parallelize via OpenMP
 typedef void (*BVHCallback) (const Face *face0, const Face *face1);
 
-void for_overlapping_faces (BVHNode *node, float thickness,
-                            BVHCallback callback);
-void for_overlapping_faces (BVHNode *node0, BVHNode *node1, float thickness,
+// Queries for intersecting faces, with thickness only padding the boxes,
+// can skip subtrees that cannot intersect themselves; proximity queries
+// cannot. Faces of instances are brought up to date before the callback
+// sees them.
+void for_overlapping_faces (const BVHTree &tree, int node, float thickness,
+                            BVHCallback callback, bool intersecting=false);
+void for_overlapping_faces (const BVHTree &tree0, int node0,
+                            const BVHTree &tree1, int node1, float thickness,
                             BVHCallback callback);
 void for_overlapping_faces (const std::vector<AccelStruct*> &accs,
                             const std::vector<AccelStruct*> &obs_accs,
                             double thickness, BVHCallback callback,
-                            bool parallel=true);
+                            bool intersecting=false, bool parallel=true);
 void for_faces_overlapping_obstacles (const std::vector<AccelStruct*> &accs,
                                       const std::vector<AccelStruct*> &obs_accs,
                                       double thickness, BVHCallback callback,
@@ -64,6 +76,19 @@ std::vector<AccelStruct*> create_accel_structs
     (const std::vector<Mesh*> &meshes, bool ccd);
 void destroy_accel_structs (std::vector<AccelStruct*> &accs);
 
+// Each node and edge is owned by one of its faces, whose box contains its
+// own, so tests between the nodes and edges of overlapping faces need only
+// be done from their owners
+inline const Face *owner (const Node *node) {
+    for (int v = 0; v < node->verts.size(); v++)
+        if (!node->verts[v]->adjf.empty())
+            return node->verts[v]->adjf[0];
+    return NULL;
+}
+inline const Face *owner (const Edge *edge) {
+    return edge->adjf[0] ? edge->adjf[0] : edge->adjf[1];
+}
+
 // find index of mesh containing specified element
 template <typename Prim>
 int find_mesh (const Prim *p, const std::vector<Mesh*> &meshes);
@@ -75,6 +75,8 @@ void parse_obstacles (vector<Obstacle>&, const Json::Value&,
 void parse_morphs (vector<Morph>&, const Json::Value&, const vector<Cloth> &);
 void parse (Wind&, const Json::Value&);
 void parse (Magic&, const Json::Value&);
+void parse (Simulation::Adaptive&, const Json::Value&);
+void parse_solver (vector<Cloth>&, const Json::Value&);
 
 void load_json (const string &configFilename, Simulation &sim) {
     Json::Value json;
@@ -125,6 +127,7 @@ void load_json (const string &configFilename, Simulation &sim) {
     }
     sim.time = 0;
     parse(sim.cloths, json["cloths"]);
+    parse_solver(sim.cloths, json["solver"]);
     parse_motions(sim.motions, json["motions"]);
     parse_handles(sim.handles, json["handles"], sim.cloths, sim.motions);
     parse_obstacles(sim.obstacles, json["obstacles"], sim.motions);
@@ -143,6 +146,7 @@ void load_json (const string &configFilename, Simulation &sim) {
                 sim.enabled[i] = false;
     }
     parse(::magic, json["magic"]);
+    parse(sim.adaptive, json["adaptive"]);
     // disable strain limiting and plasticity if not needed
     bool has_strain_limits = false, has_plasticity = false;
     for (int c = 0; c < sim.cloths.size(); c++)
@@ -280,8 +284,7 @@ void parse (Cloth::Material *&material, const Json::Value &json) {
     stretching_mult *= thicken;
     bending_mult *= thicken;
     material->density *= density_mult;
-    for (int i = 0; i < sizeof(material->stretching.s)/sizeof(Vec4); i++)
-        ((Vec4*)&material->stretching.s)[i] *= stretching_mult;
+    material->stretching.scale *= stretching_mult;
     for (int i = 0; i < sizeof(material->bending.d)/sizeof(double); i++)
         ((double*)&material->bending.d)[i] *= bending_mult;
     parse(material->damping, json["damping"], 0.);
@@ -569,6 +572,24 @@ void parse (Wind &wind, const Json::Value &json) {
     parse(wind.drag, json["drag"], 0.);
 }
 
+// Linear solver for implicit_update, shared by all cloths in the scene
+
+void parse_solver (vector<Cloth> &cloths, const Json::Value &json) {
+    string method;
+    parse(method, json["method"], string("taucs"));
+    for (int c = 0; c < cloths.size(); c++) {
+        Cloth::System &sys = cloths[c].system;
+        if (method == "taucs")
+            sys.method = Cloth::System::Taucs;
+        else if (method == "pcg")
+            sys.method = Cloth::System::Pcg;
+        else
+            complain(json["method"], "\"taucs\" or \"pcg\"");
+        parse(sys.pcg.tolerance, json["tolerance"], sys.pcg.tolerance);
+        parse(sys.pcg.max_iter, json["max_iter"], sys.pcg.max_iter);
+    }
+}
+
 void parse (Magic &magic, const Json::Value &json) {
 #define PARSE_MAGIC(param) parse(magic.param, json[#param], magic.param)
     PARSE_MAGIC(fixed_high_res_mesh);
@@ -581,9 +602,19 @@ void parse (Magic &magic, const Json::Value &json) {
     PARSE_MAGIC(rib_stiffening);
     PARSE_MAGIC(combine_tensors);
     PARSE_MAGIC(preserve_creases);
+    PARSE_MAGIC(obstacle_distance_field);
 #undef PARSE_MAGIC
 }
 
+void parse (Simulation::Adaptive &adaptive, const Json::Value &json) {
+    adaptive.enabled = !json.isNull(); // an empty object means defaults
+    parse(adaptive.max_span, json["max_span"], 8);
+    parse(adaptive.max_dx, json["max_dx"], ::magic.repulsion_thickness);
+    parse(adaptive.max_iter, json["max_iter"], 10);
+    adaptive.span = 1;
+    adaptive.nsteps = adaptive.nrollbacks = 0;
+}
+
 // JSON materials
 
 void parse (StretchingSamples&, const Json::Value&);
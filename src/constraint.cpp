@@ -33,7 +33,7 @@ double EqCon::value (int *sign) {
     if (sign) *sign = 0;
     return dot(n, node->x - x);
 }
-MeshGrad EqCon::gradient () {MeshGrad grad; grad[node] = n; return grad;}
+MeshGrad EqCon::gradient () {MeshGrad grad(n); grad.add(node, 1); return grad;}
 MeshGrad EqCon::project () {return MeshGrad();}
 double EqCon::energy (double value) {return stiff*sq(value)/2.;}
 double EqCon::energy_grad (double value) {return stiff*value;}
@@ -45,9 +45,9 @@ double GlueCon::value (int *sign) {
     return dot(n, nodes[1]->x - nodes[0]->x);
 }
 MeshGrad GlueCon::gradient () {
-    MeshGrad grad;
-    grad[nodes[0]] = -n;
-    grad[nodes[1]] = n;
+    MeshGrad grad(n);
+    grad.add(nodes[0], -1);
+    grad.add(nodes[1], 1);
     return grad;
 }
 MeshGrad GlueCon::project () {return MeshGrad();}
@@ -67,9 +67,9 @@ double IneqCon::value (int *sign) {
 }
 
 MeshGrad IneqCon::gradient () {
-    MeshGrad grad;
+    MeshGrad grad(n);
     for (int i = 0; i < 4; i++)
-        grad[nodes[i]] = w[i]*n;
+        grad.add(nodes[i], w[i]);
     return grad;
 }
 
@@ -81,10 +81,10 @@ MeshGrad IneqCon::project () {
     for (int i = 0; i < 4; i++)
         if (free[i])
             inv_mass += sq(w[i])/nodes[i]->m;
-    MeshGrad dx;
+    MeshGrad dx(n);
     for (int i = 0; i < 4; i++)
         if (free[i])
-            dx[nodes[i]] = -(w[i]/nodes[i]->m)/inv_mass*n*d;
+            dx.add(nodes[i], -(w[i]/nodes[i]->m)/inv_mass*d);
     return dx;
 }
 
@@ -118,16 +118,36 @@ MeshGrad IneqCon::friction (double dt, MeshHess &jac) {
     double vt = norm(T*v);
     double f_by_v = min(mu*fn/vt, 1/(dt*inv_mass));
     // double f_by_v = mu*fn/max(vt, 1e-1);
-    MeshGrad force;
-    for (int i = 0; i < 4; i++) {
+    MeshGrad force(T*v);
+    int free_ix[4];
+    for (int i = 0; i < 4; i++)
         if (free[i]) {
-            force[nodes[i]] = -w[i]*f_by_v*T*v;
-            for (int j = 0; j < 4; j++) {
-                if (free[j]) {
-                    jac[make_pair(nodes[i],nodes[j])] = -w[i]*w[j]*f_by_v*T;
-                }
-            }
+            free_ix[force.n] = i;
+            force.add(nodes[i], -w[i]*f_by_v);
         }
-    }
+    jac.dir = T;
+    for (int i = 0; i < force.n; i++)
+        for (int j = 0; j < force.n; j++)
+            jac.w[i][j] = -w[free_ix[i]]*w[free_ix[j]]*f_by_v;
     return force;
 }
+
+static const size_t arena_block_size = 1 << 20;
+
+ConstraintArena::~ConstraintArena () {
+    for (int b = 0; b < blocks.size(); b++)
+        delete[] blocks[b];
+}
+
+void *ConstraintArena::allocate (size_t size) {
+    size = (size + 15) & ~(size_t)15; // keep every object 16-byte aligned
+    if (used + size > arena_block_size) {
+        block++;
+        used = 0;
+    }
+    if (block == blocks.size())
+        blocks.push_back(new char[arena_block_size]);
+    void *p = blocks[block] + used;
+    used += size;
+    return p;
+}
@@ -32,11 +32,33 @@
 #include "spline.hpp"
 #include "util.hpp"
 #include "vectors.hpp"
-#include <map>
+#include <new>
 #include <vector>
 
-typedef std::map<Node*,Vec3> MeshGrad;
-typedef std::map<std::pair<Node*,Node*>,Mat3x3> MeshHess;
+// Per-node vectors of a constraint (gradient, projection or friction
+// force), stored inline for its at most four nodes. All of them are
+// multiples of one direction: the vector for nodes[i] is w[i]*dir.
+struct MeshGrad {
+    int n;
+    Node *nodes[4];
+    double w[4];
+    Vec3 dir;
+    MeshGrad (): n(0) {}
+    explicit MeshGrad (const Vec3 &dir): n(0), dir(dir) {}
+    void add (Node *node, double weight) {
+        nodes[n] = node;
+        w[n] = weight;
+        n++;
+    }
+    Vec3 operator[] (int i) const {return w[i]*dir;}
+};
+
+// Matrices coupling the nodes of a MeshGrad: w[i][j]*dir for nodes i and j
+struct MeshHess {
+    double w[4][4];
+    Mat3x3 dir;
+    Mat3x3 operator() (int i, int j) const {return w[i][j]*dir;}
+};
 
 struct Constraint {
     virtual ~Constraint () {};
@@ -47,7 +69,7 @@ struct Constraint {
     virtual double energy (double value) = 0;
     virtual double energy_grad (double value) = 0;
     virtual double energy_hess (double value) = 0;
-    // frictional force
+    // frictional force, and its Jacobian over the force's nodes
     virtual MeshGrad friction (double dt, MeshHess &jac) = 0;
 };
 
@@ -96,4 +118,23 @@ struct IneqCon: public Constraint {
     MeshGrad friction (double dt, MeshHess &jac);
 };
 
+// Storage for constraints that only live for one simulation step. They are
+// bump-allocated from blocks which are kept between steps, and all released
+// at once by reset(). Constraints hold no resources, so no destructors run.
+struct ConstraintArena {
+    ConstraintArena (): block(0), used(0) {}
+    ~ConstraintArena ();
+    template <typename Con> Con *create () {
+        return new (allocate(sizeof(Con))) Con;
+    }
+    void reset () {block = 0; used = 0;}
+private:
+    std::vector<char*> blocks;
+    int block; // block being filled
+    size_t used; // bytes used in it
+    void *allocate (size_t size);
+    ConstraintArena (const ConstraintArena&);
+    ConstraintArena &operator= (const ConstraintArena&);
+};
+
 #endif
@@ -35,8 +35,43 @@ static const int nsamples = 30;
 
 Vec4 evaluate_stretching_sample (const Mat2x2 &G, const StretchingData &data);
 
-void evaluate_stretching_samples (StretchingSamples &samples,
-                                  const StretchingData &data) {
+// Samples in single precision, each stored once, with G01 varying fastest
+// so that the two G01 neighbours a trilinear lookup needs at each (G00, G11)
+// corner of its cell are adjacent; a lookup reads four such 32-byte pairs.
+struct StretchingTable {
+    typedef float Sample[4];
+    StretchingData data; // what the samples were evaluated from
+    vector<float> storage;
+    Sample *samples; // [nsamples][nsamples][nsamples], 64-byte aligned
+    const Sample *row (int i, int j) const {
+        return &samples[(i*::nsamples + j)*::nsamples];
+    }
+};
+
+static bool operator== (const StretchingData &data0,
+                        const StretchingData &data1) {
+    for (int i = 0; i < 2; i++)
+        for (int j = 0; j < 5; j++)
+            if (data0.d[i][j] != data1.d[i][j])
+                return false;
+    return true;
+}
+
+static const StretchingTable *make_stretching_table
+    (const StretchingData &data) {
+    // tables are never freed, since materials aren't either
+    static vector<const StretchingTable*> tables;
+    for (int t = 0; t < tables.size(); t++)
+        if (tables[t]->data == data)
+            return tables[t];
+    StretchingTable *table = new StretchingTable;
+    table->data = data;
+    int ntotal = ::nsamples*::nsamples*::nsamples;
+    int nfloats = sizeof(StretchingTable::Sample)/sizeof(float);
+    table->storage.resize((ntotal + 4)*nfloats); // room to align
+    size_t offset = (-(size_t)&table->storage[0] & 63)/sizeof(float);
+    table->samples = (StretchingTable::Sample*)&table->storage[offset];
+#pragma omp parallel for
     for(int i = 0; i < ::nsamples; i++)
         for(int j = 0; j < ::nsamples; j++)
             for(int k = 0; k < ::nsamples; k++)
@@ -45,8 +80,20 @@ void evaluate_stretching_samples (StretchingSamples &samples,
                     G(0,0)=-0.25+i/(::nsamples*1.0);
                     G(1,1)=-0.25+j/(::nsamples*1.0);
                     G(0,1)=G(1,0)=k/(::nsamples*1.0);
-                    samples.s[i][j][k] = evaluate_stretching_sample(G, data);
+                    Vec4 sample = evaluate_stretching_sample(G, data);
+                    float *stored = table->samples[(i*::nsamples + j)
+                                                   *::nsamples + k];
+                    for (int l = 0; l < 4; l++)
+                        stored[l] = sample[l];
                 }
+    tables.push_back(table);
+    return table;
+}
+
+void evaluate_stretching_samples (StretchingSamples &samples,
+                                  const StretchingData &data) {
+    samples.table = make_stretching_table(data);
+    samples.scale = 1;
 }
 
 Vec4 evaluate_stretching_sample (const Mat2x2 &_G, const StretchingData &data) {
@@ -103,24 +150,22 @@ Vec4 stretching_stiffness (const Mat2x2 &G, const StretchingSamples &samples) {
     a=a-ai;
     b=b-bi;
     c=c-ci;
-    double weight[2][2][2];
-    weight[0][0][0]=(1-a)*(1-b)*(1-c);
-    weight[0][0][1]=(1-a)*(1-b)*(  c);
-    weight[0][1][0]=(1-a)*(  b)*(1-c);
-    weight[0][1][1]=(1-a)*(  b)*(  c);
-    weight[1][0][0]=(  a)*(1-b)*(1-c);
-    weight[1][0][1]=(  a)*(1-b)*(  c);
-    weight[1][1][0]=(  a)*(  b)*(1-c);
-    weight[1][1][1]=(  a)*(  b)*(  c);
+    double weight[2][2];
+    weight[0][0]=(1-a)*(1-b);
+    weight[0][1]=(1-a)*(  b);
+    weight[1][0]=(  a)*(1-b);
+    weight[1][1]=(  a)*(  b);
     Vec4 stiffness = Vec4(0);
     for(int i=0; i<2; i++)
         for(int j=0; j<2; j++)
-            for(int k=0; k<2; k++)
+            {
+                const StretchingTable::Sample *row =
+                    samples.table->row(ai+i, bi+j);
                 for(int l=0; l<4; l++)
-                    {
-                        stiffness[l]+=samples.s[ai+i][bi+j][ci+k][l]*weight[i][j][k];
-                    }
-    return stiffness;
+                    stiffness[l]+=(row[ci][l]*(1-c)
+                                   + row[ci+1][l]*c)*weight[i][j];
+            }
+    return stiffness*samples.scale;
 }
 
 double bending_stiffness (const Edge *edge, int side,
@@ -34,7 +34,14 @@ typedef Vec<4> Vec4;
 
 struct StretchingData {Vec4 d[2][5];};
 
-struct StretchingSamples {Vec4 s[40][40][40];};
+// Stretching stiffnesses sampled over a grid of strains, stored compactly
+// in a table that is shared by all materials with the same data; scale
+// holds per-material multipliers.
+struct StretchingTable;
+struct StretchingSamples {
+    const StretchingTable *table;
+    double scale;
+};
 
 struct BendingData {double d[3][5];};
 
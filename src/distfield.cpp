@@ -0,0 +1,136 @@
+/*
+  Copyright ©2013 The Regents of the University of California
+  (Regents). All Rights Reserved. Permission to use, copy, modify, and
+  distribute this software and its documentation for educational,
+  research, and not-for-profit purposes, without fee and without a
+  signed licensing agreement, is hereby granted, provided that the
+  above copyright notice, this paragraph and the following two
+  paragraphs appear in all copies, modifications, and
+  distributions. Contact The Office of Technology Licensing, UC
+  Berkeley, 2150 Shattuck Avenue, Suite 510, Berkeley, CA 94720-1620,
+  (510) 643-7201, for commercial licensing opportunities.
+
+  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT,
+  INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+  LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS
+  DOCUMENTATION, EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY
+  OF SUCH DAMAGE.
+
+  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING
+  DOCUMENTATION, IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS
+  IS". REGENTS HAS NO OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT,
+  UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+*/
+
+#include "distfield.hpp"
+
+#include "geometry.hpp"
+#include <algorithm>
+#include <omp.h>
+using namespace std;
+
+// cells are keyed by their integer coordinates, 21 bits each
+static const int cell_bits = 21, cell_offset = 1 << (cell_bits - 1);
+
+static long long cell_key (int i, int j, int k) {
+    return ((long long)(i + cell_offset) << 2*cell_bits)
+         | ((long long)(j + cell_offset) << cell_bits)
+         | (long long)(k + cell_offset);
+}
+
+static int cell_coord (long long key, int c) {
+    return (int)((key >> (2 - c)*cell_bits) & ((1 << cell_bits) - 1))
+         - cell_offset;
+}
+
+static double face_distance (const Vec3 &x, const Face *face, Vec3 *p=NULL) {
+    const Vec3 &x0 = face->v[0]->node->x, &x1 = face->v[1]->node->x,
+               &x2 = face->v[2]->node->x;
+    Vec3 n;
+    double w[4];
+    double d = unsigned_vf_distance(x, x0, x1, x2, &n, w);
+    if (p)
+        *p = -(w[1]*x0 + w[2]*x1 + w[3]*x2);
+    return d;
+}
+
+DistanceField::DistanceField (const vector<Mesh*> &meshes, double band):
+    band(band) {
+    for (int m = 0; m < meshes.size(); m++)
+        for (int f = 0; f < meshes[m]->faces.size(); f++)
+            faces.push_back(meshes[m]->faces[f]);
+    // each face goes into the cells within the band of it, taken from those
+    // its box, grown by the band, overlaps
+    double half_diagonal = band*sqrt(3.)/2;
+    int nthreads = omp_get_max_threads();
+    vector< vector<Entry> > thread_entries(nthreads);
+#pragma omp parallel for schedule(static)
+    for (int f = 0; f < faces.size(); f++) {
+        vector<Entry> &es = thread_entries[omp_get_thread_num()];
+        const Face *face = faces[f];
+        int lo[3], hi[3];
+        for (int c = 0; c < 3; c++) {
+            double xmin = infinity, xmax = -infinity;
+            for (int v = 0; v < 3; v++) {
+                xmin = min(xmin, face->v[v]->node->x[c]);
+                xmax = max(xmax, face->v[v]->node->x[c]);
+            }
+            lo[c] = (int)floor((xmin - band)/band);
+            hi[c] = (int)floor((xmax + band)/band);
+        }
+        for (int i = lo[0]; i <= hi[0]; i++)
+            for (int j = lo[1]; j <= hi[1]; j++)
+                for (int k = lo[2]; k <= hi[2]; k++) {
+                    Entry e;
+                    e.cell = cell_key(i, j, k);
+                    e.d = face_distance(center(e.cell), face);
+                    if (e.d > band + half_diagonal)
+                        continue;
+                    e.face = f;
+                    es.push_back(e);
+                }
+    }
+    for (int t = 0; t < nthreads; t++)
+        append(entries, thread_entries[t]);
+    sort(entries.begin(), entries.end());
+    for (int e = 0; e < entries.size(); ) {
+        int e0 = e;
+        while (e < entries.size() && entries[e].cell == entries[e0].cell)
+            e++;
+        cells[entries[e0].cell] = make_pair(e0, e);
+    }
+}
+
+Vec3 DistanceField::center (long long cell) const {
+    return band*Vec3(cell_coord(cell, 0) + 0.5, cell_coord(cell, 1) + 0.5,
+                     cell_coord(cell, 2) + 0.5);
+}
+
+Vec3 DistanceField::nearest_point (const Vec3 &x, double *d) const {
+    long long cell = cell_key((int)floor(x[0]/band), (int)floor(x[1]/band),
+                              (int)floor(x[2]/band));
+    unordered_map< long long, pair<int,int> >::const_iterator it =
+        cells.find(cell);
+    if (d)
+        *d = band;
+    if (it == cells.end())
+        return x;
+    // a face is no nearer to x than its distance to the center, less x's
+    double r = norm(x - center(cell)), dmin = band;
+    Vec3 p = x;
+    for (int e = it->second.first; e < it->second.second; e++) {
+        if (entries[e].d - r >= dmin)
+            break;
+        Vec3 q;
+        double dq = face_distance(x, faces[entries[e].face], &q);
+        if (dq < dmin) {
+            dmin = dq;
+            p = q;
+        }
+    }
+    if (d)
+        *d = dmin;
+    return p;
+}
@@ -0,0 +1,62 @@
+/*
+  Copyright ©2013 The Regents of the University of California
+  (Regents). All Rights Reserved. Permission to use, copy, modify, and
+  distribute this software and its documentation for educational,
+  research, and not-for-profit purposes, without fee and without a
+  signed licensing agreement, is hereby granted, provided that the
+  above copyright notice, this paragraph and the following two
+  paragraphs appear in all copies, modifications, and
+  distributions. Contact The Office of Technology Licensing, UC
+  Berkeley, 2150 Shattuck Avenue, Suite 510, Berkeley, CA 94720-1620,
+  (510) 643-7201, for commercial licensing opportunities.
+
+  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT,
+  INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+  LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS
+  DOCUMENTATION, EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY
+  OF SUCH DAMAGE.
+
+  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING
+  DOCUMENTATION, IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS
+  IS". REGENTS HAS NO OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT,
+  UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+*/
+
+#ifndef DISTFIELD_HPP
+#define DISTFIELD_HPP
+
+#include "mesh.hpp"
+#include <unordered_map>
+
+// Sparse narrow-band distance field of a set of meshes, on a grid whose
+// cells are as wide as the band. Each cell near the meshes keeps the faces
+// that may come within the band of it, nearest to its center first, so a
+// query only tests the first few faces of a single cell.
+struct DistanceField {
+    DistanceField (const std::vector<Mesh*> &meshes, double band);
+    // nearest point on the meshes closer than the band to x, or x itself,
+    // with its distance or the band in d
+    Vec3 nearest_point (const Vec3 &x, double *d=NULL) const;
+private:
+    struct Entry {
+        long long cell;
+        double d; // from the cell's center to the face
+        int face;
+        bool operator< (const Entry &e) const {
+            if (cell != e.cell)
+                return cell < e.cell;
+            if (d != e.d)
+                return d < e.d;
+            return face < e.face;
+        }
+    };
+    double band;
+    std::vector<const Face*> faces;
+    std::vector<Entry> entries;
+    std::unordered_map< long long, std::pair<int,int> > cells;
+    Vec3 center (long long cell) const;
+};
+
+#endif
@@ -31,6 +31,7 @@ using namespace std;
 static Vec3 directions[3] = {Vec3(1,0,0), Vec3(0,1,0), Vec3(0,0,1)};
 
 void add_position_constraints (const Node *node, const Vec3 &x, double stiff,
+                               ConstraintArena &arena,
                                vector<Constraint*> &cons);
 
 Transformation normalize (const Transformation &T) {
@@ -39,7 +40,8 @@ Transformation normalize (const Transformation &T) {
     return T1;
 }
 
-vector<Constraint*> NodeHandle::get_constraints (double t) {
+vector<Constraint*> NodeHandle::get_constraints (double t,
+                                                 ConstraintArena &arena) {
     double s = strength(t);
     if (!s)
         return vector<Constraint*>();
@@ -50,11 +52,12 @@ vector<Constraint*> NodeHandle::get_constraints (double t) {
     }
     Vec3 x = motion ? normalize(motion->pos(t)).apply(x0) : x0;
     vector<Constraint*> cons;
-    add_position_constraints(node, x, s*::magic.handle_stiffness, cons);
+    add_position_constraints(node, x, s*::magic.handle_stiffness, arena, cons);
     return cons;
 }
 
-vector<Constraint*> CircleHandle::get_constraints (double t) {
+vector<Constraint*> CircleHandle::get_constraints (double t,
+                                                   ConstraintArena &arena) {
     double s = strength(t);
     if (!s)
         return vector<Constraint*>();
@@ -74,18 +77,20 @@ vector<Constraint*> CircleHandle::get_constraints (double t) {
                 continue;
             l += edge->l;
         }
-        add_position_constraints(node, x, s*::magic.handle_stiffness*l, cons);
+        add_position_constraints(node, x, s*::magic.handle_stiffness*l, arena,
+                                 cons);
     }
     return cons;
 }
 
-vector<Constraint*> GlueHandle::get_constraints (double t) {
+vector<Constraint*> GlueHandle::get_constraints (double t,
+                                                 ConstraintArena &arena) {
     double s = strength(t);
     if (!s)
         return vector<Constraint*>();
     vector<Constraint*> cons;
     for (int i = 0; i < 3; i++) {
-        GlueCon *con = new GlueCon;
+        GlueCon *con = arena.create<GlueCon>();
         con->nodes[0] = nodes[0];
         con->nodes[1] = nodes[1];
         con->n = directions[i];
@@ -96,9 +101,10 @@ vector<Constraint*> GlueHandle::get_constraints (double t) {
 }
 
 void add_position_constraints (const Node *node, const Vec3 &x, double stiff,
+                               ConstraintArena &arena,
                                vector<Constraint*> &cons) {
     for (int i = 0; i < 3; i++) {
-        EqCon *con = new EqCon;
+        EqCon *con = arena.create<EqCon>();
         con->node = (Node*)node;
         con->x = x;
         con->n = directions[i];
@@ -34,7 +34,10 @@
 struct Handle {
     double start_time, end_time, fade_time;
     virtual ~Handle () {};
-    virtual std::vector<Constraint*> get_constraints (double t) = 0;
+    // constraints are allocated in the arena
+    virtual std::vector<Constraint*> get_constraints (double t,
+                                                      ConstraintArena &arena)
+        = 0;
     virtual std::vector<Node*> get_nodes () = 0;
     bool active (double t) {return t >= start_time && t <= end_time;}
     double strength (double t) {
@@ -51,7 +54,8 @@ struct NodeHandle: public Handle {
     bool activated;
     Vec3 x0;
     NodeHandle (): activated(false) {}
-    std::vector<Constraint*> get_constraints (double t);
+    std::vector<Constraint*> get_constraints (double t,
+                                              ConstraintArena &arena);
     std::vector<Node*> get_nodes () {return std::vector<Node*>(1, node);}
 };
 
@@ -62,13 +66,15 @@ struct CircleHandle: public Handle {
     double c; // circumference
     Vec2 u;
     Vec3 xc, dx0, dx1;
-    std::vector<Constraint*> get_constraints (double t);
+    std::vector<Constraint*> get_constraints (double t,
+                                              ConstraintArena &arena);
     std::vector<Node*> get_nodes () {return std::vector<Node*>();}
 };
 
 struct GlueHandle: public Handle {
     Node* nodes[2];
-    std::vector<Constraint*> get_constraints (double t);
+    std::vector<Constraint*> get_constraints (double t,
+                                              ConstraintArena &arena);
     std::vector<Node*> get_nodes () {
         std::vector<Node*> ns;
         ns.push_back(nodes[0]);
@@ -0,0 +1,166 @@
+/*
+  Copyright ©2013 The Regents of the University of California
+  (Regents). All Rights Reserved. Permission to use, copy, modify, and
+  distribute this software and its documentation for educational,
+  research, and not-for-profit purposes, without fee and without a
+  signed licensing agreement, is hereby granted, provided that the
+  above copyright notice, this paragraph and the following two
+  paragraphs appear in all copies, modifications, and
+  distributions. Contact The Office of Technology Licensing, UC
+  Berkeley, 2150 Shattuck Avenue, Suite 510, Berkeley, CA 94720-1620,
+  (510) 643-7201, for commercial licensing opportunities.
+
+  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT,
+  INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+  LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS
+  DOCUMENTATION, EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY
+  OF SUCH DAMAGE.
+
+  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING
+  DOCUMENTATION, IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS
+  IS". REGENTS HAS NO OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT,
+  UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+*/
+
+#include "instance.hpp"
+
+#include <omp.h>
+using namespace std;
+
+void RigidInstance::attach (Mesh &base, Mesh &mesh, const Pose &pose) {
+    this->base = &base;
+    this->mesh = &mesh;
+    radius = 0;
+    for (int n = 0; n < base.nodes.size(); n++)
+        radius = max(radius, norm(base.nodes[n]->x));
+    node_versions.assign(mesh.nodes.size(), -1);
+    face_versions.assign(mesh.faces.size(), -1);
+    set_pose(pose);
+    attached = true;
+}
+
+void RigidInstance::detach () {
+    update_all();
+    attached = false;
+}
+
+void RigidInstance::set_pose (const Pose &pose) {
+    this->pose = pose;
+    version++;
+    nodes.clear();
+    faces.clear();
+    pose_changed();
+}
+
+void RigidInstance::move (const Transformation &trans1, double dt) {
+    Pose pose = this->pose;
+    pose.vtrans0 = pose.trans;
+    pose.vtrans1 = trans1;
+    pose.vdt = dt;
+    set_pose(pose);
+}
+
+void RigidInstance::step () {
+    pose.trans = pose.vtrans1;
+    pose_changed();
+    update(0, 0);
+}
+
+void RigidInstance::update_x0 () {
+    pose.trans0 = pose.trans;
+    pose_changed();
+    update(0, 0);
+}
+
+void RigidInstance::update (const vector<const Face*> &faces) {
+    int n0 = nodes.size(), f0 = this->faces.size();
+    for (int f = 0; f < faces.size(); f++) {
+        Face *face = (Face*)faces[f];
+        if (face_versions[face->index] == version)
+            continue;
+        face_versions[face->index] = version;
+        this->faces.push_back(face);
+        for (int v = 0; v < 3; v++) {
+            Node *node = face->v[v]->node;
+            if (node_versions[node->index] == version)
+                continue;
+            node_versions[node->index] = version;
+            nodes.push_back(node);
+        }
+    }
+    update(n0, f0);
+}
+
+void RigidInstance::update_all () {
+    int n0 = nodes.size(), f0 = faces.size();
+    for (int n = 0; n < mesh->nodes.size(); n++)
+        if (node_versions[n] != version) {
+            node_versions[n] = version;
+            nodes.push_back(mesh->nodes[n]);
+        }
+    for (int f = 0; f < mesh->faces.size(); f++)
+        if (face_versions[f] != version) {
+            face_versions[f] = version;
+            faces.push_back(mesh->faces[f]);
+        }
+    update(n0, f0);
+}
+
+// recomputes the nodes and faces from n0 and f0 on
+void RigidInstance::update (int n0, int f0) {
+    const Pose &p = pose;
+#pragma omp parallel for
+    for (int i = n0; i < nodes.size(); i++) {
+        Node *node = nodes[i];
+        const Node *node0 = base->nodes[node->index];
+        node->x = p.trans.apply(node0->x);
+        node->x0 = p.trans0.apply(node0->x);
+        node->v = (p.vtrans1.apply(node0->x) - p.vtrans0.apply(node0->x))
+                / p.vdt;
+        node->n = p.trans.apply_vec(node0->n);
+    }
+#pragma omp parallel for
+    for (int i = f0; i < faces.size(); i++) {
+        Face *face = faces[i];
+        face->n = p.trans.apply_vec(base->faces[face->index]->n);
+    }
+}
+
+static Mat3x3 linear_part (const Transformation &trans) {
+    return trans.scale*Mat3x3(trans.apply_vec(Vec3(1,0,0)),
+                              trans.apply_vec(Vec3(0,1,0)),
+                              trans.apply_vec(Vec3(0,0,1)));
+}
+
+double RigidInstance::displacement (const Transformation &trans0,
+                                    const Transformation &trans1) const {
+    return norm(trans1.translation - trans0.translation)
+         + norm_F(linear_part(trans1) - linear_part(trans0))*radius;
+}
+
+void RigidInstance::pose_changed () {
+    inv = inverse(pose.trans);
+    sweep = displacement(pose.trans0, pose.trans);
+}
+
+// The nodes move linearly from x0 to x, so over the step each stays within
+// sweep of where the x pose puts it, and a box mapped by the inverse of the
+// x pose and grown by sweep holds every base-frame point that may meet it
+BOX RigidInstance::to_base (const BOX &box, bool ccd) const {
+    BOX base_box;
+    for (int c = 0; c < 8; c++)
+        base_box += inv.apply(Vec3(box._dist[c&1 ? 9 : 0],
+                                   box._dist[c&2 ? 10 : 1],
+                                   box._dist[c&4 ? 11 : 2]));
+    return ccd ? dilate(base_box, sweep/pose.trans.scale) : base_box;
+}
+
+const DistanceField &RigidInstance::distance_field (double band) {
+    if (!field || band > this->band) {
+        field.reset(new DistanceField(vector<Mesh*>(1, base), band));
+        this->band = band;
+    }
+    return *field;
+}
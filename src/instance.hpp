@@ -0,0 +1,90 @@
+/*
+  Copyright ©2013 The Regents of the University of California
+  (Regents). All Rights Reserved. Permission to use, copy, modify, and
+  distribute this software and its documentation for educational,
+  research, and not-for-profit purposes, without fee and without a
+  signed licensing agreement, is hereby granted, provided that the
+  above copyright notice, this paragraph and the following two
+  paragraphs appear in all copies, modifications, and
+  distributions. Contact The Office of Technology Licensing, UC
+  Berkeley, 2150 Shattuck Avenue, Suite 510, Berkeley, CA 94720-1620,
+  (510) 643-7201, for commercial licensing opportunities.
+
+  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT,
+  INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+  LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS
+  DOCUMENTATION, EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY
+  OF SUCH DAMAGE.
+
+  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING
+  DOCUMENTATION, IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS
+  IS". REGENTS HAS NO OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT,
+  UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+*/
+
+#ifndef INSTANCE_HPP
+#define INSTANCE_HPP
+
+#include "bvh.hpp"
+#include "distfield.hpp"
+#include "mesh.hpp"
+#include "transformation.hpp"
+#include <boost/shared_ptr.hpp>
+
+// A rigid obstacle's mesh placed by a pose, a similarity transform of its
+// base mesh. While attached, queries run on the base mesh's hierarchy with
+// the other side mapped into the base mesh's frame, and the world-space data
+// of the mesh is only brought up to date for the faces the queries reach, so
+// moving the obstacle costs the same whatever its resolution.
+struct RigidInstance {
+    // the poses giving the nodes' x and x0, and v as the difference of two
+    // poses over a step
+    struct Pose {
+        Transformation trans, trans0, vtrans0, vtrans1;
+        double vdt;
+    };
+    Mesh *base, *mesh;
+    bool attached;
+    Pose pose;
+    RigidInstance (): base(NULL), mesh(NULL), attached(false), radius(0),
+                      sweep(0), version(0), band(-1) {}
+    // the mesh's nodes are to be brought to the pose as they are reached
+    void attach (Mesh &base, Mesh &mesh, const Pose &pose);
+    // brings all of the mesh up to date and lets it move on its own
+    void detach ();
+    // sets the pose; nodes are brought up to date again as they are reached
+    void set_pose (const Pose &pose);
+    // v now takes the nodes from where they are to trans1 over dt
+    void move (const Transformation &trans1, double dt);
+    // x moves on to where v takes it
+    void step ();
+    void update_x0 ();
+    // brings the faces and their nodes up to date; not thread-safe
+    void update (const std::vector<const Face*> &faces);
+    void update_all ();
+    // farthest any node is from its place under another pose
+    double displacement (const Transformation &trans0,
+                         const Transformation &trans1) const;
+    // a box in the base mesh's frame holding the given world-space box, grown
+    // for ccd by the farthest any node moves between its x0 and x
+    BOX to_base (const BOX &box, bool ccd) const;
+    // distance field of the base mesh, with a band of at least band
+    const DistanceField &distance_field (double band);
+private:
+    double radius; // of the base mesh about its origin
+    Transformation inv; // of the x pose
+    double sweep; // farthest a node moves between its x0 and x
+    int version;
+    std::vector<int> node_versions, face_versions;
+    // brought up to date at this version
+    std::vector<Node*> nodes;
+    std::vector<Face*> faces;
+    double band;
+    boost::shared_ptr<DistanceField> field;
+    void update (int n0, int f0);
+    void pose_changed ();
+};
+
+#endif
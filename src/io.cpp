@@ -32,6 +32,8 @@
 #include <boost/filesystem.hpp>
 #include <cassert>
 #include <cfloat>
+#include <cstdio>
+#include <cstdlib>
 #include <jsoncpp/json/json.h>
 #include <fstream>
 #include <png.h>
@@ -172,6 +174,25 @@ void load_objs (vector<Mesh*> &meshes, const string &prefix) {
         load_obj(*meshes[m], stringf("%s_%02d.obj", prefix.c_str(), m));
 }
 
+bool load_obj_positions (vector<Vec3> &xs, const string &filename) {
+    xs.clear();
+    FILE *file = fopen(filename.c_str(), "r");
+    if (!file)
+        return false;
+    char line[1024];
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] != 'v' || (line[1] != ' ' && line[1] != '\t'))
+            continue;
+        char *s = line + 1;
+        Vec3 x;
+        for (int i = 0; i < 3; i++)
+            x[i] = strtod(s, &s);
+        xs.push_back(x);
+    }
+    fclose(file);
+    return true;
+}
+
 static double angle (const Vec3 &x0, const Vec3 &x1, const Vec3 &x2) {
     Vec3 e1 = normalize(x1 - x0);
     Vec3 e2 = normalize(x2 - x0);
@@ -33,6 +33,8 @@ void triangle_to_obj (const std::string &infile, const std::string &outfile);
 
 void load_obj (Mesh &mesh, const std::string &filename);
 void load_objs (std::vector<Mesh*> &meshes, const std::string &prefix);
+// reads only the node positions; returns false if the file can't be opened
+bool load_obj_positions (std::vector<Vec3> &xs, const std::string &filename);
 
 void save_obj (const Mesh &mesh, const std::string &filename);
 void save_objs (const std::vector<Mesh*> &meshes, const std::string &prefix, bool non_rigid);
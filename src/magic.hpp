@@ -37,6 +37,7 @@ struct Magic {
     double rib_stiffening;
     bool combine_tensors;
     bool preserve_creases;
+    bool obstacle_distance_field;
     Magic ():
         fixed_high_res_mesh(false),
         handle_stiffness(1e3),
@@ -46,7 +47,8 @@ struct Magic {
         edge_flip_threshold(1e-2),
         rib_stiffening(1),
         combine_tensors(true),
-        preserve_creases(false) {}
+        preserve_creases(false),
+        obstacle_distance_field(false) {}
 };
 
 extern Magic magic;
@@ -163,6 +163,8 @@ void compute_ms_data (Node* node) {
 }
 
 void compute_ms_data (Mesh &mesh) {
+    static int last_topology_version = 0;
+    mesh.topology_version = ++last_topology_version;
     for (int f = 0; f < mesh.faces.size(); f++)
         compute_ms_data(mesh.faces[f]);
     for (int e = 0; e < mesh.edges.size(); e++)
@@ -141,6 +141,10 @@ struct Mesh {
     std::vector<Node*> nodes;
     std::vector<Edge*> edges;
     std::vector<Face*> faces;
+    // changes whenever compute_ms_data() is called, i.e. after every
+    // topology change, so that cached topological data can detect staleness
+    int topology_version;
+    Mesh (): topology_version(0) {}
     // These do *not* assume ownership, so no deletion on removal
     void add (Vert *vert);
     void add (Node *node);
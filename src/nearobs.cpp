@@ -27,9 +27,12 @@
 #include "nearobs.hpp"
 
 #include "collisionutil.hpp"
+#include "distfield.hpp"
 #include "geometry.hpp"
+#include "instance.hpp"
 #include "magic.hpp"
 #include "simulation.hpp"
+#include <boost/shared_ptr.hpp>
 #include <vector>
 using namespace std;
 
@@ -48,19 +51,79 @@ template <typename T> struct Min {
 Vec3 nearest_point (const Vec3 &x, const vector<AccelStruct*> &accs,
                     double dmin);
 
-vector<Plane> nearest_obstacle_planes (const Mesh &mesh,
-                                       const vector<Mesh*> &obs_meshes) {
+// Nearest points in the obstacles' distance fields. An instance's field is
+// of its base mesh, so it's kept across steps, and its band may be wider
+// than asked for.
+struct ObstacleFields {
+    DistanceField field; // of the meshes without an instance
+    vector<const RigidInstance*> instances;
+    vector<const DistanceField*> instance_fields;
+    ObstacleFields (const vector<Mesh*> &obs_meshes, double dmin,
+                    AccelCache &accel_cache);
+    Vec3 nearest_point (const Vec3 &x) const;
+};
+
+static vector<Mesh*> uninstanced (const vector<Mesh*> &obs_meshes,
+                                  AccelCache &accel_cache) {
+    vector<Mesh*> meshes;
+    for (int o = 0; o < obs_meshes.size(); o++)
+        if (!accel_cache.get_instance(*obs_meshes[o]))
+            meshes.push_back(obs_meshes[o]);
+    return meshes;
+}
+
+ObstacleFields::ObstacleFields (const vector<Mesh*> &obs_meshes, double dmin,
+                                AccelCache &accel_cache):
+    field(uninstanced(obs_meshes, accel_cache), dmin) {
+    for (int o = 0; o < obs_meshes.size(); o++) {
+        RigidInstance *instance = accel_cache.get_instance(*obs_meshes[o]);
+        if (!instance)
+            continue;
+        instances.push_back(instance);
+        instance_fields.push_back(&instance->distance_field(
+            dmin/instance->pose.trans.scale));
+    }
+}
+
+Vec3 ObstacleFields::nearest_point (const Vec3 &x) const {
+    double d;
+    Vec3 p = field.nearest_point(x, &d);
+    for (int i = 0; i < instances.size(); i++) {
+        const Transformation &trans = instances[i]->pose.trans;
+        Vec3 xl = inverse(trans).apply(x);
+        double dl;
+        Vec3 pl = instance_fields[i]->nearest_point(xl, &dl);
+        if (pl != xl && dl*trans.scale < d) {
+            d = dl*trans.scale;
+            p = trans.apply(pl);
+        }
+    }
+    return p;
+}
+
+vector< vector<Plane> > nearest_obstacle_planes
+    (const vector<Mesh*> &meshes, const vector<Mesh*> &obs_meshes,
+     AccelCache &accel_cache) {
     const double dmin = 10*::magic.repulsion_thickness;
-    vector<AccelStruct*> obs_accs = create_accel_structs(obs_meshes, false);
-    vector<Plane> planes(mesh.nodes.size(), make_pair(Vec3(0), Vec3(0)));
+    vector< vector<Plane> > planes(meshes.size());
+    boost::shared_ptr<ObstacleFields> fields;
+    vector<AccelStruct*> obs_accs;
+    if (::magic.obstacle_distance_field)
+        fields.reset(new ObstacleFields(obs_meshes, dmin, accel_cache));
+    else
+        obs_accs = accel_cache.get(obs_meshes, false);
+    for (int m = 0; m < meshes.size(); m++) {
+        const Mesh &mesh = *meshes[m];
+        planes[m].assign(mesh.nodes.size(), make_pair(Vec3(0), Vec3(0)));
 #pragma omp parallel for
-    for (int n = 0; n < mesh.nodes.size(); n++) {
-        Vec3 x = mesh.nodes[n]->x;
-        Vec3 p = nearest_point(x, obs_accs, dmin);
-        if (p != x)
-            planes[n] = make_pair(p, normalize(x - p));
+        for (int n = 0; n < mesh.nodes.size(); n++) {
+            Vec3 x = mesh.nodes[n]->x;
+            Vec3 p = fields ? fields->nearest_point(x)
+                            : nearest_point(x, obs_accs, dmin);
+            if (p != x)
+                planes[m][n] = make_pair(p, normalize(x - p));
+        }
     }
-    destroy_accel_structs(obs_accs);
     return planes;
 }
 
@@ -70,14 +133,31 @@ struct NearPoint {
     NearPoint (double d, const Vec3 &x): d(d), x(x) {}
 };
 
-void update_nearest_point (const Vec3 &x, BVHNode *node, NearPoint &p);
+void update_nearest_point (const Vec3 &x, const BVHTree &tree, int node,
+                           NearPoint &p);
 
 Vec3 nearest_point (const Vec3 &x, const vector<AccelStruct*> &accs,
                     double dmin) {
     NearPoint p(dmin, x);
-    for (int a = 0; a < accs.size(); a++)
-        if (accs[a]->root)
-            update_nearest_point(x, accs[a]->root, p);
+    for (int a = 0; a < accs.size(); a++) {
+        if (accs[a]->root < 0)
+            continue;
+        const RigidInstance *instance = accs[a]->instance;
+        if (!instance) {
+            update_nearest_point(x, accs[a]->tree, accs[a]->root, p);
+            continue;
+        }
+        // an instance's hierarchy is of its base mesh, so it's queried in
+        // the base frame and units
+        const Transformation &trans = instance->pose.trans;
+        Vec3 xl = inverse(trans).apply(x);
+        NearPoint pl(p.d/trans.scale, xl);
+        update_nearest_point(xl, accs[a]->tree, accs[a]->root, pl);
+        if (pl.x != xl) {
+            p.d = pl.d*trans.scale;
+            p.x = trans.apply(pl.x);
+        }
+    }
     return p.x;
 }
 
@@ -85,15 +165,16 @@ void update_nearest_point (const Vec3 &x, const Face *face, NearPoint &p);
 
 double point_box_distance (const Vec3 &x, const BOX &box);
 
-void update_nearest_point (const Vec3 &x, BVHNode *node, NearPoint &p) {
-    if (node->isLeaf())
-        update_nearest_point(x, node->getFace(), p);
+void update_nearest_point (const Vec3 &x, const BVHTree &tree, int node,
+                           NearPoint &p) {
+    if (tree.isLeaf(node))
+        update_nearest_point(x, tree.getFace(node), p);
     else {
-        double d = point_box_distance(x, node->_box);
+        double d = point_box_distance(x, tree._boxes[node]);
         if (d >= p.d)
             return;
-        update_nearest_point(x, node->getLeftChild(), p);
-        update_nearest_point(x, node->getRightChild(), p);
+        update_nearest_point(x, tree, tree.getLeftChild(node), p);
+        update_nearest_point(x, tree, tree.getRightChild(node), p);
     }
 }
 
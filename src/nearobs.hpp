@@ -27,11 +27,15 @@
 #ifndef NEAROBS_HPP
 #define NEAROBS_HPP
 
+#include "accelcache.hpp"
 #include "mesh.hpp"
 
 typedef std::pair<Vec3,Vec3> Plane;
 
-std::vector<Plane> nearest_obstacle_planes
-    (const Mesh &mesh, const std::vector<Mesh*> &obs_meshes);
+// planes for the nodes of each mesh; the obstacles are set up for the
+// queries once for all the meshes
+std::vector< std::vector<Plane> > nearest_obstacle_planes
+    (const std::vector<Mesh*> &meshes, const std::vector<Mesh*> &obs_meshes,
+     AccelCache &accel_cache);
 
 #endif
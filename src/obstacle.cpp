@@ -29,11 +29,100 @@
 #include "util.hpp"
 #include <cstdio>
 #include <algorithm>
+#include <boost/thread.hpp>
+#include <deque>
 #include <fstream>
 
 using namespace std;
 
+// Parses the body frames following the one last asked for on a thread of its
+// own, keeping up to max_frames of them ready. Only node positions are read,
+// as the structure of the body never changes.
+struct FramePrefetcher {
+    FramePrefetcher (const string &base_path):
+        base_path(base_path), next(0), expected(-1), stop(true) {}
+    ~FramePrefetcher () {halt();}
+    // returns false if the frame doesn't exist
+    bool get (int frame, vector<Vec3> &xs);
+private:
+    struct Frame {
+        int frame;
+        bool found;
+        vector<Vec3> xs;
+    };
+    static const int max_frames = 4;
+    string base_path;
+    int next, expected; // next frame to load and to be asked for
+    bool stop;
+    deque<Frame> frames;
+    boost::mutex mutex;
+    boost::condition_variable changed;
+    boost::thread thread;
+    void start (int frame);
+    void halt ();
+    void run ();
+};
+
+bool FramePrefetcher::get (int frame, vector<Vec3> &xs) {
+    if (frame != expected) {
+        halt();
+        start(frame);
+    }
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (frames.empty())
+        changed.wait(lock);
+    Frame &f = frames.front();
+    bool found = f.found;
+    swap(xs, f.xs);
+    frames.pop_front();
+    expected = frame + 1;
+    changed.notify_all();
+    return found;
+}
+
+void FramePrefetcher::start (int frame) {
+    frames.clear();
+    next = expected = frame;
+    stop = false;
+    thread = boost::thread(&FramePrefetcher::run, this);
+}
+
+void FramePrefetcher::halt () {
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        stop = true;
+        changed.notify_all();
+    }
+    if (thread.joinable())
+        thread.join();
+}
+
+void FramePrefetcher::run () {
+    while (true) {
+        Frame f;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!stop && frames.size() >= max_frames)
+                changed.wait(lock);
+            if (stop)
+                return;
+            f.frame = next++;
+        }
+        f.found = load_obj_positions(
+            f.xs, base_path + stringf("body%04d.obj", f.frame));
+        boost::lock_guard<boost::mutex> lock(mutex);
+        if (stop)
+            return;
+        frames.push_back(f);
+        changed.notify_all();
+        if (!f.found)
+            return;
+    }
+}
+
 Mesh& Obstacle::get_mesh() {
+    if (instance.attached)
+        instance.update_all();
     return curr_state_mesh;
 }
 
@@ -42,11 +131,11 @@ const Mesh& Obstacle::get_mesh() const {
 }
 
 Mesh& Obstacle::get_mesh(double time) {
+    if (instance.attached)
+        instance.detach();
     if (time > end_time) {
         delete_mesh(base_mesh);
         delete_mesh(curr_state_mesh);
-        delete_mesh(next_state_mesh);
-        delete_mesh(cache_mesh);
     }
     if (time < start_time || time > end_time)
         return curr_state_mesh;
@@ -73,8 +162,6 @@ Mesh& Obstacle::get_mesh(double time, int frame) {
     if (time > end_time) {
         delete_mesh(base_mesh);
         delete_mesh(curr_state_mesh);
-        delete_mesh(next_state_mesh);
-        delete_mesh(cache_mesh);
     }
     if (time < start_time || time > end_time)
         return curr_state_mesh;
@@ -85,21 +172,27 @@ Mesh& Obstacle::get_mesh(double time, int frame) {
         curr_frame = -1;
         activated = true;
     } else {
-        if (frame > curr_frame) {
+        if (frame > curr_frame && !finished) {
             curr_frame = frame;
-            string next_state_mesh_path = base_path + stringf("body%04d.obj", frame);
-            if (!fstream(next_state_mesh_path.c_str(), ios::in)) {
-                delete_mesh(base_mesh);
-                delete_mesh(curr_state_mesh);
-                delete_mesh(cache_mesh);
-                delete_mesh(next_state_mesh);
-                cout << "Done." << endl;
-                exit(1);
+            if (!prefetcher)
+                prefetcher.reset(new FramePrefetcher(base_path));
+            vector<Vec3> xs;
+            if (!prefetcher->get(frame, xs)) {
+                // hold the last frame; the caller stops the simulation
+                finished = true;
+                prefetcher.reset();
+                return curr_state_mesh;
+            }
+            if (xs.size() != curr_state_mesh.nodes.size()) {
+                cout << "Error: body frame " << frame << " has " << xs.size()
+                     << " nodes instead of " << curr_state_mesh.nodes.size()
+                     << endl;
+                exit(EXIT_FAILURE);
             }
-            delete_mesh(cache_mesh);
-            cache_mesh = deep_copy(curr_state_mesh);
-            delete_mesh(next_state_mesh);
-            load_obj(next_state_mesh, next_state_mesh_path);
+            cache_positions.resize(xs.size());
+            for (int n = 0; n < curr_state_mesh.nodes.size(); n++)
+                cache_positions[n] = curr_state_mesh.nodes[n]->x;
+            swap(next_state_positions, xs);
         }
     }
     return curr_state_mesh;
@@ -122,8 +215,43 @@ void Obstacle::blend_with_previous (double t, double dt, double blend) {
 
 void Obstacle::blend_with_next (double blend) {
     Mesh &mesh = curr_state_mesh;
+    // past the last frame the body holds still
+    if (finished || next_state_positions.empty())
+        return;
     for (int n = 0; n < mesh.nodes.size(); n++) {
         Node *node = mesh.nodes[n];
-        node->x = node->x + blend * (next_state_mesh.nodes[n]->x - cache_mesh.nodes[n]->x);
+        node->x = node->x + blend * (next_state_positions[n] - cache_positions[n]);
+    }
+}
+
+bool Obstacle::move (double t, double dt) {
+    if (!instance.attached)
+        return false;
+    if (t < start_time || t > end_time) {
+        instance.detach();
+        return false;
     }
+    instance.move(pose(t), dt);
+    return true;
+}
+
+void Obstacle::attach (double t, double dt, double tolerance) {
+    if (instance.attached || !activated || t < start_time || t > end_time)
+        return;
+    // the nodes are at x0, with v taking them to time t
+    const Mesh &mesh = curr_state_mesh;
+    Transformation trans0 = pose(t - dt), trans1 = pose(t);
+    for (int n = 0; n < mesh.nodes.size(); n++) {
+        const Node *node = mesh.nodes[n];
+        const Vec3 &x = base_mesh.nodes[n]->x;
+        if (norm(node->x0 - trans0.apply(x)) > tolerance
+            || norm(node->x0 + dt*node->v - trans1.apply(x)) > tolerance)
+            return;
+    }
+    RigidInstance::Pose pose = {trans0, trans0, trans0, trans1, dt};
+    instance.attach(base_mesh, curr_state_mesh, pose);
+}
+
+Transformation Obstacle::pose (double t) const {
+    return transform_spline ? get_trans(*transform_spline, t) : identity();
 }
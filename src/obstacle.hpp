@@ -27,9 +27,13 @@
 #ifndef OBSTACLE_HPP
 #define OBSTACLE_HPP
 
+#include "instance.hpp"
 #include "mesh.hpp"
 #include "spline.hpp"
 #include "util.hpp"
+#include <boost/shared_ptr.hpp>
+
+struct FramePrefetcher;
 
 // A class which holds both moving and static meshes.
 // Note that moving meshes MUST retain their structure across frames with only
@@ -45,6 +49,9 @@ public:
 	// current frame index
 	int curr_frame;
 
+	// set once a non-rigid obstacle has run out of frames
+	bool finished;
+
 	// Gets the last-returned mesh or its transformation
 	Mesh& get_mesh();
 	const Mesh& get_mesh() const;
@@ -59,22 +66,37 @@ public:
 
 	// lerp with previous mesh at time t - dt
 	void blend_with_previous (double t, double dt, double blend);
-	// lerp with next_state_mesh
+	// lerp towards next_state_positions
 	void blend_with_next (double blend);
 
+	// Rigid obstacles are moved through their instance while it's attached.
+	// move() moves an attached one to time t, a step of dt on, or detaches
+	// it once t leaves its active time span; attach() attaches one whose
+	// nodes are back on its poses, after its world-space mesh has been moved
+	// to time t a step of dt on.
+	bool move (double t, double dt);
+	void attach (double t, double dt, double tolerance);
+	// pose of the base mesh at time t
+	Transformation pose (double t) const;
+
 	const Motion *transform_spline;
 
 	// A mesh containing the original, untransformed object
 	Mesh base_mesh;
-	// A mesh containing the correct mesh structure from next frame
-	// used as sim.non_rigid == true
-	Mesh next_state_mesh;
 	// A mesh containing the correct mesh structure from current timestamp / frame
 	Mesh curr_state_mesh;
-	// cache the mesh at the beginning of each frame
-	Mesh cache_mesh;
-
-	Obstacle (): start_time(0), end_time(infinity), activated(false) {}
+	// Node positions of the next frame, used as sim.non_rigid == true
+	// (the structure never changes across frames)
+	std::vector<Vec3> next_state_positions;
+	// cache the node positions at the beginning of each frame
+	std::vector<Vec3> cache_positions;
+	// loads the frames after the current one in the background
+	boost::shared_ptr<FramePrefetcher> prefetcher;
+	// curr_state_mesh as a pose of base_mesh, for rigid obstacles
+	RigidInstance instance;
+
+	Obstacle (): start_time(0), end_time(infinity), activated(false),
+	             finished(false) {}
 };
 
 // // Default arguments imply it's a static obstacle
@@ -0,0 +1,119 @@
+/*
+  Copyright ©2013 The Regents of the University of California
+  (Regents). All Rights Reserved. Permission to use, copy, modify, and
+  distribute this software and its documentation for educational,
+  research, and not-for-profit purposes, without fee and without a
+  signed licensing agreement, is hereby granted, provided that the
+  above copyright notice, this paragraph and the following two
+  paragraphs appear in all copies, modifications, and
+  distributions. Contact The Office of Technology Licensing, UC
+  Berkeley, 2150 Shattuck Avenue, Suite 510, Berkeley, CA 94720-1620,
+  (510) 643-7201, for commercial licensing opportunities.
+
+  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT,
+  INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+  LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS
+  DOCUMENTATION, EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY
+  OF SUCH DAMAGE.
+
+  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING
+  DOCUMENTATION, IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS
+  IS". REGENTS HAS NO OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT,
+  UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+*/
+
+#include "pcg.hpp"
+
+#include "util.hpp"
+#include <cmath>
+using namespace std;
+
+static const bool verbose = false;
+
+PcgSolver::PcgSolver ():
+    tolerance(1e-6), max_iter(1000), nsolves(0), niters(0), nfailures(0) {}
+
+static void multiply (const BsrMat<Mat3x3> &A, const vector<Vec3> &x,
+                      vector<Vec3> &y) {
+#pragma omp parallel for
+    for (int i = 0; i < A.m; i++) {
+        Vec3 yi = Vec3(0);
+        for (int k = A.rowptr[i]; k < A.rowptr[i+1]; k++)
+            yi += A.entries[k]*x[A.colind[k]];
+        y[i] = yi;
+    }
+}
+
+// Dot products are summed over fixed-size chunks, and the chunks' sums are
+// added in order, so the iterates don't depend on the number of threads.
+static const int dot_chunk = 1024;
+
+static double dot (const vector<Vec3> &x, const vector<Vec3> &y) {
+    int n = x.size(), nchunks = (n + dot_chunk - 1)/dot_chunk;
+    vector<double> sums(nchunks);
+#pragma omp parallel for
+    for (int c = 0; c < nchunks; c++) {
+        double d = 0;
+        for (int i = c*dot_chunk; i < min((c + 1)*dot_chunk, n); i++)
+            d += dot(x[i], y[i]);
+        sums[c] = d;
+    }
+    double d = 0;
+    for (int c = 0; c < nchunks; c++)
+        d += sums[c];
+    return d;
+}
+
+bool PcgSolver::solve (const BsrMat<Mat3x3> &A, const vector<Vec3> &b,
+                       vector<Vec3> &x) {
+    int n = A.m;
+    nsolves++;
+    x.resize(n, Vec3(0));
+    vector<Mat3x3> Minv(n);
+#pragma omp parallel for
+    for (int i = 0; i < n; i++)
+        Minv[i] = A(i,i).inv();
+    vector<Vec3> r(n), z(n), p(n), q(n);
+    multiply(A, x, q);
+#pragma omp parallel for
+    for (int i = 0; i < n; i++) {
+        r[i] = b[i] - q[i];
+        z[i] = Minv[i]*r[i];
+        p[i] = z[i];
+    }
+    double b_norm2 = dot(b, b), r_norm2 = dot(r, r), rz = dot(r, z);
+    double tol2 = sq(tolerance)*b_norm2;
+    int iter = 0;
+    while (r_norm2 > tol2 && iter < max_iter) {
+        multiply(A, p, q);
+        double pq = dot(p, q);
+        // A is not positive definite along p, or the iterate has blown up
+        if (!(pq > 0) || !std::isfinite(pq))
+            break;
+        double alpha = rz/pq;
+#pragma omp parallel for
+        for (int i = 0; i < n; i++) {
+            x[i] += alpha*p[i];
+            r[i] -= alpha*q[i];
+            z[i] = Minv[i]*r[i];
+        }
+        double rz_new = dot(r, z);
+        double beta = rz_new/rz;
+        rz = rz_new;
+#pragma omp parallel for
+        for (int i = 0; i < n; i++)
+            p[i] = z[i] + beta*p[i];
+        r_norm2 = dot(r, r);
+        iter++;
+    }
+    niters += iter;
+    if (verbose)
+        REPORT(iter);
+    if (!(r_norm2 <= tol2)) {
+        nfailures++;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,48 @@
+/*
+  Copyright ©2013 The Regents of the University of California
+  (Regents). All Rights Reserved. Permission to use, copy, modify, and
+  distribute this software and its documentation for educational,
+  research, and not-for-profit purposes, without fee and without a
+  signed licensing agreement, is hereby granted, provided that the
+  above copyright notice, this paragraph and the following two
+  paragraphs appear in all copies, modifications, and
+  distributions. Contact The Office of Technology Licensing, UC
+  Berkeley, 2150 Shattuck Avenue, Suite 510, Berkeley, CA 94720-1620,
+  (510) 643-7201, for commercial licensing opportunities.
+
+  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT,
+  INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+  LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS
+  DOCUMENTATION, EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY
+  OF SUCH DAMAGE.
+
+  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING
+  DOCUMENTATION, IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS
+  IS". REGENTS HAS NO OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT,
+  UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+*/
+
+#ifndef PCG_HPP
+#define PCG_HPP
+
+#include "bsr.hpp"
+#include "vectors.hpp"
+#include <vector>
+
+// Conjugate gradient solver for the symmetric positive definite systems of
+// implicit_update, with a 3x3 block-Jacobi preconditioner. The solution
+// vector passed in is used as the initial guess, so the previous step's
+// solution can warm-start it.
+struct PcgSolver {
+    double tolerance; // on the residual norm, relative to the rhs norm
+    int max_iter;
+    int nsolves, niters, nfailures; // statistics
+    PcgSolver ();
+    // returns false if the tolerance was not reached within max_iter
+    bool solve (const BsrMat<Mat3x3> &A, const std::vector<Vec3> &b,
+                std::vector<Vec3> &x);
+};
+
+#endif
@@ -27,15 +27,16 @@
 #include "physics.hpp"
 
 #include "blockvectors.hpp"
+#include "bsr.hpp"
 #include "collisionutil.hpp"
 #include "sparse.hpp"
 #include "taucs.hpp"
+#include <omp.h>
 
 using namespace std;
 
 static const bool verbose = false;
 
-static const vector<Cloth::Material*> *materials;
 
 typedef Mat<9,9> Mat9x9;
 typedef Mat<9,6> Mat9x6;
@@ -66,24 +67,26 @@ template <int n> Mat<1,n> rowmat (const Vec<n> &v) {
     Mat<1,n> A; for (int i = 0; i < n; i++) A(0,i) = v[i]; return A;}
 
 template <Space s>
-double stretching_energy (const Face *face) {
+double stretching_energy (const Face *face,
+                          const vector<Cloth::Material*> &materials) {
     Mat3x2 F = derivative(pos<s>(face->v[0]->node), pos<s>(face->v[1]->node),
                           pos<s>(face->v[2]->node), face);
     Mat2x2 G = (F.t()*F - Mat2x2(1))/2.;
-    Vec4 k = stretching_stiffness(G, (*::materials)[face->label]->stretching);
-    double weakening = (*::materials)[face->label]->weakening;
+    Vec4 k = stretching_stiffness(G, materials[face->label]->stretching);
+    double weakening = materials[face->label]->weakening;
     k *= 1/(1 + weakening*face->damage);
     return face->a*(k[0]*sq(G(0,0)) + k[2]*sq(G(1,1))
                     + 2*k[1]*G(0,0)*G(1,1) + k[3]*sq(G(0,1)))/2.;
 }
 
 template <Space s>
-pair<Mat9x9,Vec9> stretching_force (const Face *face) {
+pair<Mat9x9,Vec9> stretching_force
+    (const Face *face, const vector<Cloth::Material*> &materials) {
     Mat3x2 F = derivative(pos<s>(face->v[0]->node), pos<s>(face->v[1]->node),
                           pos<s>(face->v[2]->node), face);
     Mat2x2 G = (F.t()*F - Mat2x2(1))/2.;
-    Vec4 k = stretching_stiffness(G, (*::materials)[face->label]->stretching);
-    double weakening = (*::materials)[face->label]->weakening;
+    Vec4 k = stretching_stiffness(G, materials[face->label]->stretching);
+    double weakening = materials[face->label]->weakening;
     k *= 1/(1 + weakening*face->damage);
     // eps = 1/2(F'F - I) = 1/2([x_u^2 & x_u x_v \\ x_u x_v & x_v^2] - I)
     // e = 1/2 k0 eps00^2 + k1 eps00 eps11 + 1/2 k2 eps11^2 + k3 eps01^2
@@ -111,18 +114,19 @@ typedef Mat<12,12> Mat12x12;
 typedef Vec<12> Vec12;
 
 template <Space s>
-double bending_energy (const Edge *edge) {
+double bending_energy (const Edge *edge,
+                       const vector<Cloth::Material*> &materials) {
     const Face *face0 = edge->adjf[0], *face1 = edge->adjf[1];
     if (!face0 || !face1)
         return 0;
     double theta = dihedral_angle<s>(edge);
     double a = face0->a + face1->a;
-    const BendingData &bend0 = (*::materials)[face0->label]->bending,
-                      &bend1 = (*::materials)[face1->label]->bending;
+    const BendingData &bend0 = materials[face0->label]->bending,
+                      &bend1 = materials[face1->label]->bending;
     double ke = min(bending_stiffness(edge, 0, bend0),
                     bending_stiffness(edge, 1, bend1));
-    double weakening = max((*::materials)[face0->label]->weakening,
-                           (*::materials)[face1->label]->weakening);
+    double weakening = max(materials[face0->label]->weakening,
+                           materials[face1->label]->weakening);
     ke *= 1/(1 + weakening*edge->damage);
     double shape = sq(edge->l)/(2*a);
     return ke*shape*sq(theta - edge->theta_ideal)/4;
@@ -142,7 +146,8 @@ Vec2 barycentric_weights (const Vec3 &x, const Vec3 &a, const Vec3 &b) {
 }
 
 template <Space s>
-pair<Mat12x12,Vec12> bending_force (const Edge *edge) {
+pair<Mat12x12,Vec12> bending_force
+    (const Edge *edge, const vector<Cloth::Material*> &materials) {
     const Face *face0 = edge->adjf[0], *face1 = edge->adjf[1];
     if (!face0 || !face1)
         return make_pair(Mat12x12(0), Vec12(0));
@@ -160,12 +165,12 @@ pair<Mat12x12,Vec12> bending_force (const Edge *edge) {
                                      -(w_f0[1]*n0/h0 + w_f1[1]*n1/h1),
                                      n0/h0,
                                      n1/h1));
-    const BendingData &bend0 = (*::materials)[face0->label]->bending,
-                      &bend1 = (*::materials)[face1->label]->bending;
+    const BendingData &bend0 = materials[face0->label]->bending,
+                      &bend1 = materials[face1->label]->bending;
     double ke = min(bending_stiffness(edge, 0, bend0),
                     bending_stiffness(edge, 1, bend1));
-    double weakening = max((*::materials)[face0->label]->weakening,
-                           (*::materials)[face1->label]->weakening);
+    double weakening = max(materials[face0->label]->weakening,
+                           materials[face1->label]->weakening);
     ke *= 1/(1 + weakening*edge->damage);
     double shape = sq(edge->l)/(2*a);
     return make_pair(-ke*shape*outer(dtheta, dtheta)/2.,
@@ -193,6 +198,14 @@ template <int m> void add_submat (const Mat<m*3,m*3> &Asub, const Vec<m,int> &ix
             A(ix[i],ix[j]) += submat3(Asub, i,j);
 }
 
+template <int m> void add_submat (const Mat<m,m> &Asub,
+                                  const Vec<m*m/9,int> &slots,
+                                  BsrMat<Mat3x3> &A) {
+    for (int i = 0; i < m/3; i++)
+        for (int j = 0; j < m/3; j++)
+            A.entries[slots[i*(m/3)+j]] += submat3(Asub, i,j);
+}
+
 template <int m> void add_subvec (const Vec<m*3> &bsub, const Vec<m,int> &ix, vector<Vec3> &b) {
     for (int i = 0; i < m; i++)
         b[ix[i]] += subvec3(bsub, i);
@@ -222,12 +235,11 @@ Vec<4,int> indices (const Node *n0, const Node *n1,
 template <Space s>
 double internal_energy (const Cloth &cloth) {
     const Mesh &mesh = cloth.mesh;
-    ::materials = &cloth.materials;
     double E = 0;
     for (int f = 0; f < mesh.faces.size(); f++)
-        E += stretching_energy<s>(mesh.faces[f]);
+        E += stretching_energy<s>(mesh.faces[f], cloth.materials);
     for (int e = 0; e < mesh.edges.size(); e++) {
-        E += bending_energy<s>(mesh.edges[e]);
+        E += bending_energy<s>(mesh.edges[e], cloth.materials);
     }
     return E;
 }
@@ -237,56 +249,341 @@ template double internal_energy<WS> (const Cloth&);
 // A = dt^2 J + dt damp J
 // b = dt f + dt^2 J v + dt damp J v
 
+// Element contributions go into a SpMat by node index, or into the cached
+// system matrix through the slots precomputed for each face and edge
+
+static void add_face_submat (const Mat9x9 &Asub, const Face *face,
+                             const Vec<3,int> &ix, SpMat<Mat3x3> &A) {
+    add_submat(Asub, ix, A);
+}
+
+static void add_face_submat (const Mat9x9 &Asub, const Face *face,
+                             const Vec<3,int> &ix, Cloth::System &sys) {
+    add_submat(Asub, sys.face_slots[face->index], sys.A);
+}
+
+static void add_edge_submat (const Mat12x12 &Asub, const Edge *edge,
+                             const Vec<4,int> &ix, SpMat<Mat3x3> &A) {
+    add_submat(Asub, ix, A);
+}
+
+static void add_edge_submat (const Mat12x12 &Asub, const Edge *edge,
+                             const Vec<4,int> &ix, Cloth::System &sys) {
+    add_submat(Asub, sys.edge_slots[edge->index], sys.A);
+}
+
+// Batched element kernels. A batch of up to nlanes faces or edges is packed
+// structure-of-arrays style, one lane per element, so that the arithmetic
+// vectorizes across elements; the stiffness lookups need gathers and stay
+// scalar. They compute the same forces as stretching_force and bending_force;
+// builds with CHECK_KERNELS defined, as the debug build is, compare the two.
+
+static const int nlanes = 4;
+
+template <Space s>
+static void stretching_forces (const Face *const *faces, int n,
+                               const vector<Cloth::Material*> &materials,
+                               double J[81][nlanes], double F[9][nlanes]) {
+    double x[9][nlanes], du[3][nlanes], dv[3][nlanes];
+    for (int l = 0; l < nlanes; l++) {
+        const Face *face = faces[min(l, n-1)]; // pad with the last face
+        Mat2x3 D = derivative(face);
+        for (int a = 0; a < 3; a++) {
+            const Vec3 &xa = pos<s>(face->v[a]->node);
+            for (int i = 0; i < 3; i++)
+                x[a*3+i][l] = xa[i];
+            du[a][l] = D(0,a);
+            dv[a][l] = D(1,a);
+        }
+    }
+    double xu[3][nlanes], xv[3][nlanes], G[3][nlanes];
+#pragma omp simd
+    for (int l = 0; l < nlanes; l++) {
+        for (int i = 0; i < 3; i++) {
+            xu[i][l] = du[0][l]*x[i][l] + du[1][l]*x[3+i][l]
+                     + du[2][l]*x[6+i][l];
+            xv[i][l] = dv[0][l]*x[i][l] + dv[1][l]*x[3+i][l]
+                     + dv[2][l]*x[6+i][l];
+        }
+        G[0][l] = (xu[0][l]*xu[0][l] + xu[1][l]*xu[1][l] + xu[2][l]*xu[2][l]
+                   - 1)/2.;
+        G[1][l] = (xv[0][l]*xv[0][l] + xv[1][l]*xv[1][l] + xv[2][l]*xv[2][l]
+                   - 1)/2.;
+        G[2][l] = (xu[0][l]*xv[0][l] + xu[1][l]*xv[1][l]
+                   + xu[2][l]*xv[2][l])/2.;
+    }
+    double k[4][nlanes];
+    for (int l = 0; l < nlanes; l++) {
+        const Face *face = faces[min(l, n-1)];
+        const Cloth::Material *material = materials[face->label];
+        Mat2x2 Gl = Mat2x2(Vec2(G[0][l], G[2][l]), Vec2(G[2][l], G[1][l]));
+        Vec4 kl = stretching_stiffness(Gl, material->stretching);
+        kl *= -face->a/(1 + material->weakening*face->damage);
+        for (int i = 0; i < 4; i++)
+            k[i][l] = kl[i];
+    }
+    // grad e = cu fuu + cv fvv + cuv fuv, and the Du'Du and Dv'Dv terms of
+    // hess e are (du du') kron I and (dv dv') kron I
+#pragma omp simd
+    for (int l = 0; l < nlanes; l++) {
+        double g00 = G[0][l], g11 = G[1][l], g01 = G[2][l];
+        double k0 = k[0][l], k1 = k[1][l], k2 = k[2][l], k3 = k[3][l];
+        double cu = k0*g00 + k1*g11, cv = k2*g11 + k1*g00, cuv = 2*k3*g01;
+        double p0 = max(g00, 0.), p1 = max(g11, 0.);
+        double su = k0*p0 + k1*p1, sv = k2*p1 + k1*p0;
+        double fuu[9], fvv[9], fuv[9];
+        for (int a = 0; a < 3; a++) {
+            for (int i = 0; i < 3; i++) {
+                fuu[a*3+i] = du[a][l]*xu[i][l];
+                fvv[a*3+i] = dv[a][l]*xv[i][l];
+                fuv[a*3+i] = (du[a][l]*xv[i][l] + dv[a][l]*xu[i][l])/2.;
+            }
+        }
+        for (int r = 0; r < 9; r++)
+            F[r][l] = cu*fuu[r] + cv*fvv[r] + cuv*fuv[r];
+        for (int r = 0; r < 9; r++)
+            for (int c = 0; c < 9; c++)
+                J[r*9+c][l] = k0*fuu[r]*fuu[c] + k2*fvv[r]*fvv[c]
+                            + k1*(fuu[r]*fvv[c] + fvv[r]*fuu[c])
+                            + 2*k3*fuv[r]*fuv[c];
+        for (int a = 0; a < 3; a++)
+            for (int b = 0; b < 3; b++)
+                for (int i = 0; i < 3; i++)
+                    J[(a*3+i)*9+b*3+i][l] += su*du[a][l]*du[b][l]
+                                           + sv*dv[a][l]*dv[b][l];
+    }
+}
+
+template <Space s>
+static void bending_forces (const Edge *const *edges, int n,
+                            const vector<Cloth::Material*> &materials,
+                            double J[144][nlanes], double F[12][nlanes]) {
+    double x[12][nlanes], nrm[6][nlanes], coef[nlanes], dtheta[nlanes];
+    for (int l = 0; l < nlanes; l++) {
+        const Edge *edge = edges[min(l, n-1)];
+        const Face *face0 = edge->adjf[0], *face1 = edge->adjf[1];
+        const Node *nodes[4] = {edge->n[0], edge->n[1],
+                                edge_opp_vert(edge, 0)->node,
+                                edge_opp_vert(edge, 1)->node};
+        for (int a = 0; a < 4; a++)
+            for (int i = 0; i < 3; i++)
+                x[a*3+i][l] = pos<s>(nodes[a])[i];
+        Vec3 n0 = nor<s>(face0), n1 = nor<s>(face1);
+        for (int i = 0; i < 3; i++) {
+            nrm[i][l] = n0[i];
+            nrm[3+i][l] = n1[i];
+        }
+        const Cloth::Material *material0 = materials[face0->label],
+                              *material1 = materials[face1->label];
+        double ke = min(bending_stiffness(edge, 0, material0->bending),
+                        bending_stiffness(edge, 1, material1->bending));
+        ke *= 1/(1 + max(material0->weakening,
+                         material1->weakening)*edge->damage);
+        double shape = sq(edge->l)/(2*(face0->a + face1->a));
+        coef[l] = -ke*shape/2.;
+        dtheta[l] = dihedral_angle<s>(edge) - edge->theta_ideal;
+    }
+#pragma omp simd
+    for (int l = 0; l < nlanes; l++) {
+        double e[3], e2 = 0;
+        for (int i = 0; i < 3; i++) {
+            e[i] = x[3+i][l] - x[i][l];
+            e2 += e[i]*e[i];
+        }
+        // distance and barycentric weights of the opposite vertices
+        double w[2], h[2];
+        for (int side = 0; side < 2; side++) {
+            double d[3], t = 0;
+            for (int i = 0; i < 3; i++) {
+                d[i] = x[6+side*3+i][l] - x[i][l];
+                t += e[i]*d[i];
+            }
+            t /= e2;
+            double h2 = 0;
+            for (int i = 0; i < 3; i++)
+                h2 += sq(d[i] - e[i]*t);
+            w[side] = t;
+            h[side] = max(sqrt(h2), 1e-3*sqrt(e2));
+        }
+        double g[12];
+        for (int i = 0; i < 3; i++) {
+            double m0 = nrm[i][l]/h[0], m1 = nrm[3+i][l]/h[1];
+            g[i] = -((1-w[0])*m0 + (1-w[1])*m1);
+            g[3+i] = -(w[0]*m0 + w[1]*m1);
+            g[6+i] = m0;
+            g[9+i] = m1;
+        }
+        for (int r = 0; r < 12; r++)
+            F[r][l] = coef[l]*dtheta[l]*g[r];
+        for (int r = 0; r < 12; r++)
+            for (int c = 0; c < 12; c++)
+                J[r*12+c][l] = coef[l]*g[r]*g[c];
+    }
+}
+
+template <int m>
+static void unpack (const double J[m*m][nlanes], const double F[m][nlanes],
+                    int l, Mat<m,m> &Jl, Vec<m> &Fl) {
+    for (int r = 0; r < m; r++) {
+        Fl[r] = F[r][l];
+        for (int c = 0; c < m; c++)
+            Jl(r,c) = J[r*m+c][l];
+    }
+}
+
+#ifdef CHECK_KERNELS
+template <int m>
+static void check_kernel (const pair<Mat<m,m>,Vec<m> > &scalar,
+                          const Mat<m,m> &J, const Vec<m> &F) {
+    double errJ = norm_F(J - scalar.first)/max(norm_F(scalar.first), 1e-12),
+           errF = norm(F - scalar.second)/max(norm(scalar.second), 1e-12);
+    if (errJ > 1e-8 || errF > 1e-8) {
+        cout << "batched kernel doesn't match scalar path" << endl;
+        REPORT(errJ);
+        REPORT(errF);
+    }
+}
+#endif
+
+template <typename Matrix>
+static void add_face_forces (const Face *face, const Mat9x9 &J, const Vec9 &F,
+                             const vector<Cloth::Material*> &materials,
+                             Matrix &A, vector<Vec3> &b, double dt) {
+    const Node *n0 = face->v[0]->node, *n1 = face->v[1]->node,
+               *n2 = face->v[2]->node;
+    if (dt == 0) {
+        add_face_submat(-J, face, indices(n0,n1,n2), A);
+        add_subvec(F, indices(n0,n1,n2), b);
+    } else {
+        Vec9 vs = mat_to_vec(Mat3x3(n0->v, n1->v, n2->v));
+        double damping = materials[face->label]->damping;
+        add_face_submat(-dt*(dt+damping)*J, face, indices(n0,n1,n2), A);
+        add_subvec(dt*(F + (dt+damping)*J*vs), indices(n0,n1,n2), b);
+    }
+}
+
+template <typename Matrix>
+static void add_edge_forces (const Edge *edge, const Mat12x12 &J,
+                             const Vec12 &F,
+                             const vector<Cloth::Material*> &materials,
+                             Matrix &A, vector<Vec3> &b, double dt) {
+    const Node *n0 = edge->n[0],
+               *n1 = edge->n[1],
+               *n2 = edge_opp_vert(edge, 0)->node,
+               *n3 = edge_opp_vert(edge, 1)->node;
+    if (dt == 0) {
+        add_edge_submat(-J, edge, indices(n0,n1,n2,n3), A);
+        add_subvec(F, indices(n0,n1,n2,n3), b);
+    } else {
+        Vec12 vs = mat_to_vec(Mat3x4(n0->v, n1->v, n2->v, n3->v));
+        double damping = (materials[edge->adjf[0]->label]->damping +
+                          materials[edge->adjf[1]->label]->damping)/2.;
+        add_edge_submat(-dt*(dt+damping)*J, edge, indices(n0,n1,n2,n3),
+                        A);
+        add_subvec(dt*(F + (dt+damping)*J*vs), indices(n0,n1,n2,n3), b);
+    }
+}
+
+// adds the forces of up to nlanes faces
+template <Space s, typename Matrix>
+static void add_face_forces (const Face *const *faces, int n,
+                             const vector<Cloth::Material*> &materials,
+                             Matrix &A, vector<Vec3> &b, double dt) {
+    double J[81][nlanes], F[9][nlanes];
+    stretching_forces<s>(faces, n, materials, J, F);
+    for (int l = 0; l < n; l++) {
+        Mat9x9 Jl;
+        Vec9 Fl;
+        unpack<9>(J, F, l, Jl, Fl);
+#ifdef CHECK_KERNELS
+        check_kernel(stretching_force<s>(faces[l], materials), Jl, Fl);
+#endif
+        add_face_forces(faces[l], Jl, Fl, materials, A, b, dt);
+    }
+}
+
+// adds the forces of up to nlanes interior edges
+template <Space s, typename Matrix>
+static void add_edge_forces (const Edge *const *edges, int n,
+                             const vector<Cloth::Material*> &materials,
+                             Matrix &A, vector<Vec3> &b, double dt) {
+    double J[144][nlanes], F[12][nlanes];
+    bending_forces<s>(edges, n, materials, J, F);
+    for (int l = 0; l < n; l++) {
+        Mat12x12 Jl;
+        Vec12 Fl;
+        unpack<12>(J, F, l, Jl, Fl);
+#ifdef CHECK_KERNELS
+        check_kernel(bending_force<s>(edges[l], materials), Jl, Fl);
+#endif
+        add_edge_forces(edges[l], Jl, Fl, materials, A, b, dt);
+    }
+}
+
 template <Space s>
 void add_internal_forces (const Cloth &cloth, SpMat<Mat3x3> &A,
                           vector<Vec3> &b, double dt) {
     const Mesh &mesh = cloth.mesh;
-    ::materials = &cloth.materials;
-    for (int f = 0; f < mesh.faces.size(); f++) {
-        const Face* face = mesh.faces[f];
-        const Node *n0 = face->v[0]->node, *n1 = face->v[1]->node,
-                   *n2 = face->v[2]->node;
-        Vec9 vs = mat_to_vec(Mat3x3(n0->v, n1->v, n2->v));
-        pair<Mat9x9,Vec9> membF = stretching_force<s>(face);
-        Mat9x9 J = membF.first;
-        Vec9 F = membF.second;
-        if (dt == 0) {
-            add_submat(-J, indices(n0,n1,n2), A);
-            add_subvec(F, indices(n0,n1,n2), b);
-        } else {
-            double damping = (*::materials)[face->label]->damping;
-            add_submat(-dt*(dt+damping)*J, indices(n0,n1,n2), A);
-            add_subvec(dt*(F + (dt+damping)*J*vs), indices(n0,n1,n2), b);
-        }
-    }
+    int nf = mesh.faces.size();
+    for (int f = 0; f < nf; f += nlanes)
+        add_face_forces<s>(&mesh.faces[f], min(nlanes, nf-f),
+                           cloth.materials, A, b, dt);
+    const Edge *edges[nlanes];
+    int n = 0;
     for (int e = 0; e < mesh.edges.size(); e++) {
         const Edge *edge = mesh.edges[e];
         if (!edge->adjf[0] || !edge->adjf[1])
             continue;
-        pair<Mat12x12,Vec12> bendF = bending_force<s>(edge);
-        const Node *n0 = edge->n[0],
-                   *n1 = edge->n[1],
-                   *n2 = edge_opp_vert(edge, 0)->node,
-                   *n3 = edge_opp_vert(edge, 1)->node;
-        Vec12 vs = mat_to_vec(Mat3x4(n0->v, n1->v, n2->v, n3->v));
-        Mat12x12 J = bendF.first;
-        Vec12 F = bendF.second;
-        if (dt == 0) {
-            add_submat(-J, indices(n0,n1,n2,n3), A);
-            add_subvec(F, indices(n0,n1,n2,n3), b);
-        } else {
-            double damping = ((*::materials)[edge->adjf[0]->label]->damping +
-                              (*::materials)[edge->adjf[1]->label]->damping)/2.;
-            add_submat(-dt*(dt+damping)*J, indices(n0,n1,n2,n3), A);
-            add_subvec(dt*(F + (dt+damping)*J*vs), indices(n0,n1,n2,n3), b);
+        edges[n++] = edge;
+        if (n == nlanes) {
+            add_edge_forces<s>(edges, n, cloth.materials, A, b, dt);
+            n = 0;
         }
     }
+    if (n > 0)
+        add_edge_forces<s>(edges, n, cloth.materials, A, b, dt);
 }
 template void add_internal_forces<PS> (const Cloth&, SpMat<Mat3x3>&,
                                        vector<Vec3>&, double);
 template void add_internal_forces<WS> (const Cloth&, SpMat<Mat3x3>&,
                                        vector<Vec3>&, double);
 
+// Elements of one color share no nodes, so they touch disjoint rows of A and
+// b and can be added concurrently. Every entry still receives its
+// contributions in color order, so the result doesn't depend on the number
+// of threads.
+template <Space s>
+void add_internal_forces (const Cloth &cloth, Cloth::System &sys,
+                          vector<Vec3> &b, double dt) {
+    const Mesh &mesh = cloth.mesh;
+    for (int c = 0; c < sys.face_colors.size(); c++) {
+        const vector<int> &faces = sys.face_colors[c];
+#pragma omp parallel for
+        for (int i = 0; i < faces.size(); i += nlanes) {
+            int n = min(nlanes, (int)faces.size()-i);
+            const Face *batch[nlanes];
+            for (int l = 0; l < n; l++)
+                batch[l] = mesh.faces[faces[i+l]];
+            add_face_forces<s>(batch, n, cloth.materials, sys, b, dt);
+        }
+    }
+    for (int c = 0; c < sys.edge_colors.size(); c++) {
+        const vector<int> &edges = sys.edge_colors[c];
+#pragma omp parallel for
+        for (int i = 0; i < edges.size(); i += nlanes) {
+            int n = min(nlanes, (int)edges.size()-i);
+            const Edge *batch[nlanes];
+            for (int l = 0; l < n; l++)
+                batch[l] = mesh.edges[edges[i+l]];
+            add_edge_forces<s>(batch, n, cloth.materials, sys, b, dt);
+        }
+    }
+}
+template void add_internal_forces<PS> (const Cloth&, Cloth::System&,
+                                       vector<Vec3>&, double);
+template void add_internal_forces<WS> (const Cloth&, Cloth::System&,
+                                       vector<Vec3>&, double);
+
 bool contains (const Mesh &mesh, const Node *node) {
     return node->index < mesh.nodes.size() && mesh.nodes[node->index] == node;
 }
@@ -312,29 +609,27 @@ void add_constraint_forces (const Cloth &cloth, const vector<Constraint*> &cons,
         // f = -g*grad
         // J = -h*outer(grad,grad)
         double v_dot_grad = 0;
-        for (MeshGrad::iterator it = grad.begin(); it != grad.end(); it++) {
-            const Node *node = it->first;
-            v_dot_grad += dot(it->second, node->v);
-        }
-        for (MeshGrad::iterator it = grad.begin(); it != grad.end(); it++) {
-            const Node *nodei = it->first;
+        for (int i = 0; i < grad.n; i++)
+            v_dot_grad += dot(grad[i], grad.nodes[i]->v);
+        for (int i = 0; i < grad.n; i++) {
+            const Node *nodei = grad.nodes[i];
             if (!contains(mesh, nodei))
                 continue;
             int ni = nodei->index;
-            for (MeshGrad::iterator jt = grad.begin(); jt != grad.end(); jt++) {
-                const Node *nodej = jt->first;
+            for (int j = 0; j < grad.n; j++) {
+                const Node *nodej = grad.nodes[j];
                 if (!contains(mesh, nodej))
                     continue;
                 int nj = nodej->index;
                 if (dt == 0)
-                    A(ni,nj) += h*outer(it->second, jt->second);
+                    A(ni,nj) += h*outer(grad[i], grad[j]);
                 else
-                    A(ni,nj) += dt*dt*h*outer(it->second, jt->second);
+                    A(ni,nj) += dt*dt*h*outer(grad[i], grad[j]);
             }
             if (dt == 0)
-                b[ni] -= g*it->second;
+                b[ni] -= g*grad[i];
             else
-                b[ni] -= dt*(g + dt*h*v_dot_grad)*it->second;
+                b[ni] -= dt*(g + dt*h*v_dot_grad)*grad[i];
         }
     }
 }
@@ -345,46 +640,285 @@ void add_friction_forces (const Cloth &cloth, const vector<Constraint*> cons,
     for (int c = 0; c < cons.size(); c++) {
         MeshHess jac;
         MeshGrad force = cons[c]->friction(dt, jac);
-        for (MeshGrad::iterator it = force.begin(); it != force.end(); it++) {
-            const Node *node = it->first;
-            if (!contains(mesh, node))
+        for (int i = 0; i < force.n; i++) {
+            const Node *nodei = force.nodes[i];
+            if (!contains(mesh, nodei))
+                continue;
+            b[nodei->index] += dt*force[i];
+            for (int j = 0; j < force.n; j++) {
+                const Node *nodej = force.nodes[j];
+                if (!contains(mesh, nodej))
+                    continue;
+                A(nodei->index, nodej->index) -= dt*jac(i,j);
+            }
+        }
+    }
+}
+
+static int stencil_index (const Node *node,
+                          const Cloth::System::Stencil &stencil) {
+    for (int i = 0; i < stencil.n; i++)
+        if (stencil.nodes[i] == node)
+            return i;
+    return -1;
+}
+
+void add_constraint_forces (const Cloth &cloth, const vector<Constraint*> &cons,
+                            Cloth::System &sys, vector<Vec3> &b, double dt) {
+    for (int c = 0; c < cons.size(); c++) {
+        const Cloth::System::Stencil &stencil = sys.con_stencils[c];
+        double value = cons[c]->value();
+        double g = cons[c]->energy_grad(value);
+        double h = cons[c]->energy_hess(value);
+        MeshGrad grad = cons[c]->gradient();
+        Vec3 grads[4];
+        double v_dot_grad = 0;
+        for (int i = 0; i < grad.n; i++) {
+            grads[i] = grad[i];
+            v_dot_grad += dot(grads[i], grad.nodes[i]->v);
+        }
+        for (int i = 0; i < stencil.n; i++) {
+            int ni = stencil.ix[i];
+            if (ni < 0)
                 continue;
-            b[node->index] += dt*it->second;
+            for (int j = 0; j < stencil.n; j++) {
+                if (stencil.ix[j] < 0)
+                    continue;
+                Mat3x3 &Aij = sys.A.entries[stencil.slots[i][j]];
+                if (dt == 0)
+                    Aij += h*outer(grads[i], grads[j]);
+                else
+                    Aij += dt*dt*h*outer(grads[i], grads[j]);
+            }
+            if (dt == 0)
+                b[ni] -= g*grads[i];
+            else
+                b[ni] -= dt*(g + dt*h*v_dot_grad)*grads[i];
+        }
+    }
+}
+
+void add_friction_forces (const Cloth &cloth, const vector<Constraint*> cons,
+                          Cloth::System &sys, vector<Vec3> &b, double dt) {
+    for (int c = 0; c < cons.size(); c++) {
+        const Cloth::System::Stencil &stencil = sys.con_stencils[c];
+        MeshHess jac;
+        MeshGrad force = cons[c]->friction(dt, jac);
+        // the force's nodes are a subset of the gradient's
+        int ix[4];
+        for (int i = 0; i < force.n; i++) {
+            ix[i] = stencil_index(force.nodes[i], stencil);
+            if (ix[i] >= 0 && stencil.ix[ix[i]] >= 0)
+                b[stencil.ix[ix[i]]] += dt*force[i];
         }
-        for (MeshHess::iterator it = jac.begin(); it != jac.end(); it++) {
-            const Node *nodei = it->first.first, *nodej = it->first.second;
-            if (!contains(mesh, nodei) || !contains(mesh, nodej))
+        for (int i = 0; i < force.n; i++) {
+            for (int j = 0; j < force.n; j++) {
+                if (ix[i] < 0 || ix[j] < 0 || stencil.ix[ix[i]] < 0
+                    || stencil.ix[ix[j]] < 0)
+                    continue;
+                sys.A.entries[stencil.slots[ix[i]][ix[j]]] -= dt*jac(i,j);
+            }
+        }
+    }
+}
+
+// Sparsity pattern of the implicit system: the diagonal, the face and
+// bending stencils, and whatever couplings the current constraints add.
+// It is rebuilt only when the topology changes or a constraint couples
+// two nodes that were not coupled before.
+
+static void build_system_pattern (Cloth &cloth) {
+    const Mesh &mesh = cloth.mesh;
+    Cloth::System &sys = cloth.system;
+    int nn = mesh.nodes.size();
+    vector< vector<int> > cols(nn);
+    for (int n = 0; n < nn; n++)
+        cols[n].push_back(n);
+    for (int f = 0; f < mesh.faces.size(); f++) {
+        const Face *face = mesh.faces[f];
+        Vec<3,int> ix = indices(face->v[0]->node, face->v[1]->node,
+                                face->v[2]->node);
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                cols[ix[i]].push_back(ix[j]);
+    }
+    for (int e = 0; e < mesh.edges.size(); e++) {
+        const Edge *edge = mesh.edges[e];
+        if (!edge->adjf[0] || !edge->adjf[1])
+            continue;
+        Vec<4,int> ix = indices(edge->n[0], edge->n[1],
+                                edge_opp_vert(edge, 0)->node,
+                                edge_opp_vert(edge, 1)->node);
+        for (int i = 0; i < 4; i++)
+            for (int j = 0; j < 4; j++)
+                cols[ix[i]].push_back(ix[j]);
+    }
+    for (int c = 0; c < sys.con_stencils.size(); c++) {
+        const Cloth::System::Stencil &stencil = sys.con_stencils[c];
+        for (int i = 0; i < stencil.n; i++)
+            for (int j = 0; j < stencil.n; j++)
+                if (stencil.ix[i] >= 0 && stencil.ix[j] >= 0)
+                    cols[stencil.ix[i]].push_back(stencil.ix[j]);
+    }
+    sys.A.set_pattern(nn, nn, cols);
+    sys.face_slots.resize(mesh.faces.size());
+    for (int f = 0; f < mesh.faces.size(); f++) {
+        const Face *face = mesh.faces[f];
+        Vec<3,int> ix = indices(face->v[0]->node, face->v[1]->node,
+                                face->v[2]->node);
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                sys.face_slots[f][i*3+j] = sys.A.slot(ix[i], ix[j]);
+    }
+    sys.edge_slots.assign(mesh.edges.size(), Vec<16,int>(-1));
+    for (int e = 0; e < mesh.edges.size(); e++) {
+        const Edge *edge = mesh.edges[e];
+        if (!edge->adjf[0] || !edge->adjf[1])
+            continue;
+        Vec<4,int> ix = indices(edge->n[0], edge->n[1],
+                                edge_opp_vert(edge, 0)->node,
+                                edge_opp_vert(edge, 1)->node);
+        for (int i = 0; i < 4; i++)
+            for (int j = 0; j < 4; j++)
+                sys.edge_slots[e][i*4+j] = sys.A.slot(ix[i], ix[j]);
+    }
+    sys.topology_version = mesh.topology_version;
+}
+
+// Greedy coloring of elements such that no two elements of the same color
+// share a node. Elements are visited in index order, so the coloring only
+// depends on the mesh.
+template <int k>
+static vector< vector<int> > color_elements (const vector< Vec<k,int> > &ix,
+                                             int nn) {
+    vector< vector<int> > colors;
+    vector< vector<bool> > used; // used[c][n]: node n taken in color c
+    for (int e = 0; e < ix.size(); e++) {
+        if (ix[e][0] < 0)
+            continue;
+        int c = 0;
+        for (; c < colors.size(); c++) {
+            bool free = true;
+            for (int i = 0; i < k && free; i++)
+                free = !used[c][ix[e][i]];
+            if (free)
+                break;
+        }
+        if (c == colors.size()) {
+            colors.push_back(vector<int>());
+            used.push_back(vector<bool>(nn, false));
+        }
+        colors[c].push_back(e);
+        for (int i = 0; i < k; i++)
+            used[c][ix[e][i]] = true;
+    }
+    return colors;
+}
+
+static void color_system_elements (Cloth &cloth) {
+    const Mesh &mesh = cloth.mesh;
+    Cloth::System &sys = cloth.system;
+    vector< Vec<3,int> > face_ix(mesh.faces.size());
+    for (int f = 0; f < mesh.faces.size(); f++) {
+        const Face *face = mesh.faces[f];
+        face_ix[f] = indices(face->v[0]->node, face->v[1]->node,
+                             face->v[2]->node);
+    }
+    vector< Vec<4,int> > edge_ix(mesh.edges.size(), Vec<4,int>(-1));
+    for (int e = 0; e < mesh.edges.size(); e++) {
+        const Edge *edge = mesh.edges[e];
+        if (!edge->adjf[0] || !edge->adjf[1])
+            continue;
+        edge_ix[e] = indices(edge->n[0], edge->n[1],
+                             edge_opp_vert(edge, 0)->node,
+                             edge_opp_vert(edge, 1)->node);
+    }
+    sys.face_colors = color_elements(face_ix, mesh.nodes.size());
+    sys.edge_colors = color_elements(edge_ix, mesh.nodes.size());
+}
+
+// returns false if the constraint needs an entry missing from the pattern
+static bool find_stencil_slots (const BsrMat<Mat3x3> &A,
+                                Cloth::System::Stencil &stencil) {
+    for (int i = 0; i < stencil.n; i++) {
+        for (int j = 0; j < stencil.n; j++) {
+            if (stencil.ix[i] < 0 || stencil.ix[j] < 0)
                 continue;
-            A(nodei->index, nodej->index) -= dt*it->second;
+            stencil.slots[i][j] = A.slot(stencil.ix[i], stencil.ix[j]);
+            if (stencil.slots[i][j] < 0)
+                return false;
         }
     }
+    return true;
+}
+
+static void update_system_pattern (Cloth &cloth,
+                                   const vector<Constraint*> &cons) {
+    const Mesh &mesh = cloth.mesh;
+    Cloth::System &sys = cloth.system;
+    bool stale = (sys.topology_version != mesh.topology_version
+                  || sys.A.m != mesh.nodes.size());
+    if (stale)
+        sys.dv.clear(); // node indices may have changed
+    sys.con_stencils.resize(cons.size());
+    for (int c = 0; c < cons.size(); c++) {
+        Cloth::System::Stencil &stencil = sys.con_stencils[c];
+        MeshGrad grad = cons[c]->gradient();
+        stencil.n = grad.n;
+        for (int i = 0; i < grad.n; i++) {
+            const Node *node = grad.nodes[i];
+            stencil.nodes[i] = node;
+            stencil.ix[i] = contains(mesh, node) ? node->index : -1;
+        }
+        if (!stale && !find_stencil_slots(sys.A, stencil))
+            stale = true;
+    }
+    if (!stale)
+        return;
+    if (sys.topology_version != mesh.topology_version
+        || sys.A.m != mesh.nodes.size())
+        color_system_elements(cloth);
+    build_system_pattern(cloth);
+    for (int c = 0; c < cons.size(); c++)
+        find_stencil_slots(sys.A, sys.con_stencils[c]);
 }
 
 void project_outside (Mesh &mesh, const vector<Constraint*> &cons);
 
-void implicit_update (Cloth &cloth, const vector<Vec3> &fext,
-                      const vector<Mat3x3> &Jext,
-                      const vector<Constraint*> &cons, double dt,
-                      bool update_positions) {
+// assembles and solves the implicit system, returning the velocity change
+static vector<Vec3> implicit_solve (Cloth &cloth, const vector<Vec3> &fext,
+                                    const vector<Mat3x3> &Jext,
+                                    const vector<Constraint*> &cons,
+                                    double dt) {
     Mesh &mesh = cloth.mesh;
-    vector<Vert*>::iterator vert_it;
-    vector<Face*>::iterator face_it;
     int nn = mesh.nodes.size();
     // M Dv/Dt = F (x + Dx) = F (x + Dt (v + Dv))
     // Dv = Dt (M - Dt2 F)i F (x + Dt v)
     // A = M - Dt2 F
     // b = Dt F (x + Dt v)
-    SpMat<Mat3x3> A(nn,nn);
+    update_system_pattern(cloth, cons);
+    Cloth::System &sys = cloth.system;
+    sys.A.clear();
     vector<Vec3> b(nn, Vec3(0));
     for (int n = 0; n < mesh.nodes.size(); n++) {
         const Node* node = mesh.nodes[n];
-        A(n,n) += Mat3x3(node->m) - dt*dt*Jext[n];
+        sys.A.entries[sys.A.slot(n,n)] += Mat3x3(node->m) - dt*dt*Jext[n];
         b[n] += dt*fext[n];
     }
-    add_internal_forces<WS>(cloth, A, b, dt);
-    add_constraint_forces(cloth, cons, A, b, dt);
-    add_friction_forces(cloth, cons, A, b, dt);
-    vector<Vec3> dv = taucs_linear_solve(A, b);
+    add_internal_forces<WS>(cloth, sys, b, dt);
+    add_constraint_forces(cloth, cons, sys, b, dt);
+    add_friction_forces(cloth, cons, sys, b, dt);
+    vector<Vec3> dv = sys.dv;
+    if (sys.method != Cloth::System::Pcg || !sys.pcg.solve(sys.A, b, dv))
+        dv = sys.taucs.solve(sys.A, b);
+    sys.dv = dv;
+    return dv;
+}
+
+static void apply_velocity_change (Cloth &cloth, const vector<Vec3> &dv,
+                                   const vector<Constraint*> &cons, double dt,
+                                   bool update_positions) {
+    Mesh &mesh = cloth.mesh;
     for (int n = 0; n < mesh.nodes.size(); n++) {
         Node *node = mesh.nodes[n];
         node->v += dv[n];
@@ -396,6 +930,41 @@ void implicit_update (Cloth &cloth, const vector<Vec3> &fext,
     compute_ws_data(mesh);
 }
 
+void implicit_update (Cloth &cloth, const vector<Vec3> &fext,
+                      const vector<Mat3x3> &Jext,
+                      const vector<Constraint*> &cons, double dt,
+                      bool update_positions) {
+    vector<Vec3> dv = implicit_solve(cloth, fext, Jext, cons, dt);
+    apply_velocity_change(cloth, dv, cons, dt, update_positions);
+}
+
+void implicit_update (vector<Cloth> &cloths,
+                      const vector< vector<Vec3> > &fext,
+                      const vector< vector<Mat3x3> > &Jext,
+                      const vector<Constraint*> &cons, double dt,
+                      bool update_positions) {
+    int ncloths = cloths.size();
+    vector< vector<Vec3> > dv(ncloths);
+    // One thread per cloth, and the remaining threads split evenly among
+    // the cloths' own parallel loops, so that the total stays at
+    // omp_get_max_threads(). A single cloth keeps all threads to itself.
+    int nthreads = omp_get_max_threads();
+    int nouter = max(1, min(ncloths, nthreads)), ninner = nthreads/nouter;
+    int max_levels = omp_get_max_active_levels();
+    if (nouter > 1 && ninner > 1)
+        omp_set_max_active_levels(max(max_levels, 2));
+#pragma omp parallel for num_threads(nouter) schedule(dynamic) if(nouter > 1)
+    for (int c = 0; c < ncloths; c++) {
+        omp_set_num_threads(ninner);
+        dv[c] = implicit_solve(cloths[c], fext[c], Jext[c], cons, dt);
+    }
+    omp_set_max_active_levels(max_levels);
+    // velocities only change once every system is solved, so friction and
+    // constraints between cloths see the same state in every solve
+    for (int c = 0; c < ncloths; c++)
+        apply_velocity_change(cloths[c], dv[c], cons, dt, update_positions);
+}
+
 Vec3 wind_force (const Face *face, const Wind &wind) {
     Vec3 vface = (face->v[0]->node->v + face->v[1]->node->v
                   + face->v[2]->node->v)/3.;
@@ -445,14 +1014,15 @@ void project_outside (Mesh &mesh, const vector<Constraint*> &cons) {
     vector<Vec3> dx(nn, Vec3(0));
     for (int c = 0; c < cons.size(); c++) {
         MeshGrad dxc = cons[c]->project();
-        for (MeshGrad::iterator it = dxc.begin(); it != dxc.end(); it++) {
-            const Node *node = it->first;
-            double wn = norm2(it->second);
+        for (int i = 0; i < dxc.n; i++) {
+            const Node *node = dxc.nodes[i];
+            Vec3 dxn = dxc[i];
+            double wn = norm2(dxn);
             int n = node->index;
             if (n >= mesh.nodes.size() || mesh.nodes[n] != node)
                 continue;
             w[n] += wn;
-            dx[n] += wn*it->second;
+            dx[n] += wn*dxn;
         }
     }
     for (int n = 0; n < nn; n++) {
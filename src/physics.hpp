@@ -51,6 +51,17 @@ void add_constraint_forces (const Cloth &cloth,
                             const std::vector<Constraint*> &cons,
                             SpMat<Mat3x3> &A, std::vector<Vec3> &b, double dt);
 
+// same as above, but scatter into the cached system matrix, whose pattern
+// and stencil slots must be up to date for the mesh and constraints
+template <Space s>
+void add_internal_forces (const Cloth &cloth, Cloth::System &sys,
+                          std::vector<Vec3> &b, double dt);
+
+void add_constraint_forces (const Cloth &cloth,
+                            const std::vector<Constraint*> &cons,
+                            Cloth::System &sys, std::vector<Vec3> &b,
+                            double dt);
+
 void add_external_forces (const Cloth &cloth, const Vec3 &gravity,
                           const Wind &wind, std::vector<Vec3> &fext,
                           std::vector<Mat3x3> &Jext);
@@ -64,4 +75,11 @@ void implicit_update (Cloth &cloth, const std::vector<Vec3> &fext,
                       const std::vector<Constraint*> &cons, double dt,
                       bool update_positions=true);
 
+// updates several cloths, whose systems are solved concurrently
+void implicit_update (std::vector<Cloth> &cloths,
+                      const std::vector< std::vector<Vec3> > &fext,
+                      const std::vector< std::vector<Mat3x3> > &Jext,
+                      const std::vector<Constraint*> &cons, double dt,
+                      bool update_positions=true);
+
 #endif
@@ -180,18 +180,12 @@ void EmbedOpt::finalize (const double *x) const {
 
 void reduce_stretching_stiffnesses (vector<Cloth::Material*> &materials) {
     for (int m = 0; m < materials.size(); m++)
-        for (int i = 0; i < 40; i++)
-            for (int j = 0; j < 40; j++)
-                for (int k = 0; k < 40; k++)
-                    materials[m]->stretching.s[i][j][k] *= 1e-2;
+        materials[m]->stretching.scale *= 1e-2;
 }
 
 void restore_stretching_stiffnesses (vector<Cloth::Material*> &materials) {
     for (int m = 0; m < materials.size(); m++)
-        for (int i = 0; i < 40; i++)
-            for (int j = 0; j < 40; j++)
-                for (int k = 0; k < 40; k++)
-                    materials[m]->stretching.s[i][j][k] *= 1e2;
+        materials[m]->stretching.scale *= 1e2;
 }
 
 // ------------------------------------------------------------------ //
@@ -28,74 +28,250 @@
 
 #include "collisionutil.hpp"
 #include "geometry.hpp"
+#include "instance.hpp"
 #include "magic.hpp"
 #include "simulation.hpp"
+#include <algorithm>
+#include <omp.h>
 #include <vector>
 using namespace std;
 
-template <typename T> struct Min {
-    double key;
+// Each thread records the proximities it finds in buffers of its own, and
+// the closest one for each primitive and side is picked afterwards. Ties in
+// distance go to the lower-indexed primitive, so the result does not depend
+// on the order of the traversal or the number of threads.
+
+template <typename T> struct Proximity {
+    int slot; // 2*index + side
+    double d;
     T val;
-    Min (): key(infinity), val() {}
-    void add (double key, T val) {
-        if (key < this->key) {
-            this->key = key;
-            this->val = val;
-        }
-    }
+    Proximity (int slot, double d, T val): slot(slot), d(d), val(val) {}
 };
 
-static vector< Min<Face*> > node_prox[2];
-static vector< Min<Edge*> > edge_prox[2];
-static vector< Min<Node*> > face_prox[2];
+template <typename Prim> static int prim_index (const Prim *p) {
+    int i = get_index(p, *::meshes);
+    return i >= 0 ? i : size<Prim>(*::meshes) + get_index(p, *::obs_meshes);
+}
+
+template <typename T>
+static bool operator< (const Proximity<T> &p0, const Proximity<T> &p1) {
+    if (p0.slot != p1.slot)
+        return p0.slot < p1.slot;
+    if (p0.d != p1.d)
+        return p0.d < p1.d;
+    return prim_index(p0.val) < prim_index(p1.val);
+}
+
+static double dmin;
+static int nthreads = 0;
+static vector< Proximity<Face*> > *node_prox = NULL;
+static vector< Proximity<Edge*> > *edge_prox = NULL;
+static vector< Proximity<Node*> > *face_prox = NULL;
+
+template <typename T>
+static void find_closest (vector< Proximity<T> > *bufs,
+                          vector< Proximity<T> > &closest) {
+    vector< Proximity<T> > prox;
+    for (int t = 0; t < ::nthreads; t++)
+        append(prox, bufs[t]);
+    sort(prox.begin(), prox.end());
+    for (int p = 0; p < prox.size(); p++)
+        if (p == 0 || prox[p].slot != prox[p-1].slot)
+            closest.push_back(prox[p]);
+}
 
 void find_proximities (const Face *face0, const Face *face1);
 Constraint *make_constraint (const Node *node, const Face *face,
-                             double mu, double mu_obs);
+                             double mu, double mu_obs,
+                             ConstraintArena &arena);
 Constraint *make_constraint (const Edge *edge0, const Edge *edge1,
-                             double mu, double mu_obs);
+                             double mu, double mu_obs,
+                             ConstraintArena &arena);
 
 vector<Constraint*> proximity_constraints (const vector<Mesh*> &meshes,
                                            const vector<Mesh*> &obs_meshes,
-                                           double mu, double mu_obs) {
+                                           double mu, double mu_obs,
+                                           ConstraintArena &arena,
+                                           AccelCache &accel_cache,
+                                           ProximityCache &proximity_cache) {
     ::meshes = &meshes;
-    const double dmin = 2*::magic.repulsion_thickness;
-    vector<AccelStruct*> accs = create_accel_structs(meshes, false),
-                         obs_accs = create_accel_structs(obs_meshes, false);
-    int nn = size<Node>(meshes),
-        ne = size<Edge>(meshes),
-        nf = size<Face>(meshes);
-    for (int i = 0; i < 2; i++) {
-        ::node_prox[i].assign(nn, Min<Face*>());
-        ::edge_prox[i].assign(ne, Min<Edge*>());
-        ::face_prox[i].assign(nf, Min<Node*>());
+    ::obs_meshes = &obs_meshes;
+    ::dmin = 2*::magic.repulsion_thickness;
+    const vector<ProximityCache::FacePair> &pairs =
+        proximity_cache.get(meshes, obs_meshes, ::dmin, accel_cache);
+    if (!::node_prox) {
+        ::nthreads = omp_get_max_threads();
+        ::node_prox = new vector< Proximity<Face*> >[::nthreads];
+        ::edge_prox = new vector< Proximity<Edge*> >[::nthreads];
+        ::face_prox = new vector< Proximity<Node*> >[::nthreads];
+    }
+    for (int t = 0; t < ::nthreads; t++) {
+        ::node_prox[t].clear();
+        ::edge_prox[t].clear();
+        ::face_prox[t].clear();
+    }
+#pragma omp parallel for schedule(static)
+    for (int p = 0; p < pairs.size(); p++)
+        find_proximities(pairs[p].first, pairs[p].second);
+    vector< Proximity<Face*> > node_prox;
+    vector< Proximity<Edge*> > edge_prox;
+    vector< Proximity<Node*> > face_prox;
+#pragma omp parallel sections
+    {
+#pragma omp section
+        find_closest(::node_prox, node_prox);
+#pragma omp section
+        find_closest(::edge_prox, edge_prox);
+#pragma omp section
+        find_closest(::face_prox, face_prox);
     }
-    for_overlapping_faces(accs, obs_accs, dmin, find_proximities);
     vector<Constraint*> cons;
-    for (int n = 0; n < nn; n++)
-        for (int i = 0; i < 2; i++) {
-            Min<Face*> &m = ::node_prox[i][n];
-            if (m.key < dmin)
-                cons.push_back(make_constraint(get<Node>(n, meshes), m.val,
-                                               mu, mu_obs));
+    for (int p = 0; p < node_prox.size(); p++)
+        cons.push_back(make_constraint(get<Node>(node_prox[p].slot/2, meshes),
+                                       node_prox[p].val, mu, mu_obs, arena));
+    for (int p = 0; p < edge_prox.size(); p++)
+        cons.push_back(make_constraint(get<Edge>(edge_prox[p].slot/2, meshes),
+                                       edge_prox[p].val, mu, mu_obs, arena));
+    for (int p = 0; p < face_prox.size(); p++)
+        cons.push_back(make_constraint(face_prox[p].val,
+                                       get<Face>(face_prox[p].slot/2, meshes),
+                                       mu, mu_obs, arena));
+    return cons;
+}
+
+// Proximity cache
+
+// The margin is a multiple of the proximity distance. While no node has
+// moved by half of it, no two boxes have come closer by more than the
+// margin, so every pair now within the distance was within distance plus
+// margin when gathered.
+static const double margin_ratio = 2;
+
+static vector<ProximityCache::FacePair> *face_pairs = NULL;
+
+void gather_face_pair (const Face *face0, const Face *face1) {
+    ::face_pairs[omp_get_thread_num()].push_back(make_pair(face0, face1));
+}
+
+// Constraints on an obstacle's node or edge read the faces around it too
+static vector<const Face*> one_ring (const vector<const Face*> &faces,
+                                     const Mesh &mesh) {
+    vector<char> in(mesh.faces.size(), false);
+    vector<const Face*> ring;
+    for (int f = 0; f < faces.size(); f++)
+        for (int i = 0; i < 3; i++) {
+            const Node *node = faces[f]->v[i]->node;
+            for (int v = 0; v < node->verts.size(); v++)
+                for (int a = 0; a < node->verts[v]->adjf.size(); a++) {
+                    const Face *face = node->verts[v]->adjf[a];
+                    if (!in[face->index]) {
+                        in[face->index] = true;
+                        ring.push_back(face);
+                    }
+                }
         }
-    for (int e = 0; e < ne; e++)
-        for (int i = 0; i < 2; i++) {
-            Min<Edge*> &m = ::edge_prox[i][e];
-            if (m.key < dmin)
-                cons.push_back(make_constraint(get<Edge>(e, meshes), m.val,
-                                               mu, mu_obs));
+    return ring;
+}
+
+const vector<ProximityCache::FacePair> &ProximityCache::get
+    (const vector<Mesh*> &meshes, const vector<Mesh*> &obs_meshes,
+     double d, AccelCache &accel_cache) {
+    if (valid(meshes, obs_meshes, d, accel_cache)) {
+        for (int m = 0; m < instances.size(); m++)
+            if (instances[m])
+                instances[m]->update(instance_faces[m]);
+        return pairs;
+    }
+    clear();
+    this->d = d;
+    for (int m = 0; m < meshes.size() + obs_meshes.size(); m++) {
+        const Mesh *mesh = m < meshes.size() ? meshes[m]
+                                             : obs_meshes[m - meshes.size()];
+        RigidInstance *instance = accel_cache.get_instance(*mesh);
+        this->meshes.push_back(mesh);
+        topology_versions.push_back(mesh->topology_version);
+        nnodes.push_back(mesh->nodes.size());
+        nfaces.push_back(mesh->faces.size());
+        instances.push_back(instance);
+        poses.push_back(instance ? instance->pose.trans : identity());
+        if (instance)
+            continue;
+        for (int n = 0; n < mesh->nodes.size(); n++)
+            xs.push_back(mesh->nodes[n]->x);
+    }
+    if (!::face_pairs)
+        ::face_pairs = new vector<FacePair>[omp_get_max_threads()];
+    vector<AccelStruct*> accs = accel_cache.get(meshes, false),
+                         obs_accs = accel_cache.get(obs_meshes, false);
+    for_overlapping_faces(accs, obs_accs, (1 + margin_ratio)*d,
+                          gather_face_pair);
+    for (int t = 0; t < omp_get_max_threads(); t++) {
+        append(pairs, ::face_pairs[t]);
+        ::face_pairs[t].clear();
+    }
+    // only the second face of a pair can be an instance's
+    instance_faces.resize(instances.size());
+    for (int p = 0; p < pairs.size(); p++) {
+        int o = find_mesh(pairs[p].second, obs_meshes);
+        if (o != -1 && instances[meshes.size() + o])
+            instance_faces[meshes.size() + o].push_back(pairs[p].second);
+    }
+    for (int m = 0; m < instances.size(); m++)
+        if (instances[m]) {
+            instance_faces[m] = one_ring(instance_faces[m], *this->meshes[m]);
+            instances[m]->update(instance_faces[m]);
         }
-    for (int f = 0; f < nf; f++)
-        for (int i = 0; i < 2; i++) {
-            Min<Node*> &m = ::face_prox[i][f];
-            if (m.key < dmin)
-                cons.push_back(make_constraint(m.val, get<Face>(f, meshes),
-                                               mu, mu_obs));
+    return pairs;
+}
+
+bool ProximityCache::valid (const vector<Mesh*> &meshes,
+                            const vector<Mesh*> &obs_meshes, double d,
+                            AccelCache &accel_cache) const {
+    if (d != this->d || this->meshes.size() != meshes.size() + obs_meshes.size())
+        return false;
+    for (int m = 0; m < this->meshes.size(); m++) {
+        const Mesh *mesh = m < meshes.size() ? meshes[m]
+                                             : obs_meshes[m - meshes.size()];
+        // delete_mesh empties a mesh without touching its topology version
+        if (mesh != this->meshes[m]
+            || mesh->topology_version != topology_versions[m]
+            || mesh->nodes.size() != nnodes[m]
+            || mesh->faces.size() != nfaces[m]
+            || accel_cache.get_instance(*mesh) != instances[m])
+            return false;
+    }
+    double dmax = margin_ratio*d/2;
+    int i = 0;
+    for (int m = 0; m < this->meshes.size(); m++) {
+        if (instances[m]) {
+            if (instances[m]->displacement(poses[m], instances[m]->pose.trans)
+                >= dmax)
+                return false;
+            continue;
         }
-    destroy_accel_structs(accs);
-    destroy_accel_structs(obs_accs);
-    return cons;
+        const vector<Node*> &nodes = this->meshes[m]->nodes;
+        bool moved = false;
+#pragma omp parallel for reduction(||:moved)
+        for (int n = 0; n < nodes.size(); n++)
+            moved = moved || norm2(nodes[n]->x - xs[i + n]) >= sq(dmax);
+        if (moved)
+            return false;
+        i += nodes.size();
+    }
+    return true;
+}
+
+void ProximityCache::clear () {
+    d = -1;
+    pairs.clear();
+    meshes.clear();
+    topology_versions.clear();
+    nnodes.clear();
+    nfaces.clear();
+    xs.clear();
+    instances.clear();
+    poses.clear();
+    instance_faces.clear();
 }
 
 void add_proximity (const Node *node, const Face *face);
@@ -103,12 +279,16 @@ void add_proximity (const Edge *edge0, const Edge *edge1);
 
 void find_proximities (const Face *face0, const Face *face1) {
     for (int v = 0; v < 3; v++)
-        add_proximity(face0->v[v]->node, face1);
+        if (owner(face0->v[v]->node) == face0)
+            add_proximity(face0->v[v]->node, face1);
     for (int v = 0; v < 3; v++)
-        add_proximity(face1->v[v]->node, face0);
+        if (owner(face1->v[v]->node) == face1)
+            add_proximity(face1->v[v]->node, face0);
     for (int e0 = 0; e0 < 3; e0++)
-        for (int e1 = 0; e1 < 3; e1++)
-            add_proximity(face0->adje[e0], face1->adje[e1]);
+        if (owner(face0->adje[e0]) == face0)
+            for (int e1 = 0; e1 < 3; e1++)
+                if (owner(face1->adje[e1]) == face1)
+                    add_proximity(face0->adje[e0], face1->adje[e1]);
 }
 
 void add_proximity (const Node *node, const Face *face) {
@@ -125,13 +305,18 @@ void add_proximity (const Node *node, const Face *face) {
     bool inside = (min(-w[1], -w[2], -w[3]) >= -1e-6);
     if (!inside)
         return;
+    if (d >= ::dmin)
+        return;
+    int t = omp_get_thread_num();
     if (is_free(node)) {
         int side = dot(n, node->n)>=0 ? 0 : 1;
-        ::node_prox[side][get_index(node, *::meshes)].add(d, (Face*)face);
+        ::node_prox[t].push_back(Proximity<Face*>(
+            2*get_index(node, *::meshes) + side, d, (Face*)face));
     }
     if (is_free(face)) {
         int side = dot(-n, face->n)>=0 ? 0 : 1;
-        ::face_prox[side][get_index(face, *::meshes)].add(d, (Node*)node);
+        ::face_prox[t].push_back(Proximity<Node*>(
+            2*get_index(face, *::meshes) + side, d, (Node*)node));
     }
 }
 
@@ -164,15 +349,20 @@ void add_proximity (const Edge *edge0, const Edge *edge1) {
                    && in_wedge(-w[3], edge1, edge0));
     if (!inside)
         return;
+    if (d >= ::dmin)
+        return;
+    int t = omp_get_thread_num();
     if (is_free(edge0)) {
         Vec3 edge0n = edge0->n[0]->n + edge0->n[1]->n;
         int side = dot(n, edge0n)>=0 ? 0 : 1;
-        ::edge_prox[side][get_index(edge0, *::meshes)].add(d, (Edge*)edge1);
+        ::edge_prox[t].push_back(Proximity<Edge*>(
+            2*get_index(edge0, *::meshes) + side, d, (Edge*)edge1));
     }
     if (is_free(edge1)) {
         Vec3 edge1n = edge1->n[0]->n + edge1->n[1]->n;
         int side = dot(-n, edge1n)>=0 ? 0 : 1;
-        ::edge_prox[side][get_index(edge1, *::meshes)].add(d, (Edge*)edge0);
+        ::edge_prox[t].push_back(Proximity<Edge*>(
+            2*get_index(edge1, *::meshes) + side, d, (Edge*)edge0));
     }
 }
 
@@ -181,8 +371,9 @@ double area (const Edge *edge);
 double area (const Face *face);
 
 Constraint *make_constraint (const Node *node, const Face *face,
-                             double mu, double mu_obs) {
-    IneqCon *con = new IneqCon;
+                             double mu, double mu_obs,
+                             ConstraintArena &arena) {
+    IneqCon *con = arena.create<IneqCon>();
     con->nodes[0] = (Node*)node;
     con->nodes[1] = (Node*)face->v[0]->node;
     con->nodes[2] = (Node*)face->v[1]->node;
@@ -201,8 +392,9 @@ Constraint *make_constraint (const Node *node, const Face *face,
 }
 
 Constraint *make_constraint (const Edge *edge0, const Edge *edge1,
-                             double mu, double mu_obs) {
-    IneqCon *con = new IneqCon;
+                             double mu, double mu_obs,
+                             ConstraintArena &arena) {
+    IneqCon *con = arena.create<IneqCon>();
     con->nodes[0] = (Node*)edge0->n[0];
     con->nodes[1] = (Node*)edge0->n[1];
     con->nodes[2] = (Node*)edge1->n[0];
@@ -27,11 +27,42 @@
 #ifndef PROXIMITY_HPP
 #define PROXIMITY_HPP
 
+#include "accelcache.hpp"
 #include "cloth.hpp"
 #include "constraint.hpp"
+#include "transformation.hpp"
 
+// Face pairs within the proximity distance plus a margin, kept across calls.
+// They are gathered again only when a node has moved by half the margin
+// since, or when a mesh's topology or size has changed. Nodes of a mesh
+// placed by an attached rigid instance are bounded through the instance's
+// pose, and the faces around those in the pairs are brought up to date on
+// every get().
+struct ProximityCache {
+    typedef std::pair<const Face*, const Face*> FacePair;
+    ProximityCache (): d(-1) {}
+    const std::vector<FacePair> &get (const std::vector<Mesh*> &meshes,
+                                      const std::vector<Mesh*> &obs_meshes,
+                                      double d, AccelCache &accel_cache);
+    void clear ();
+private:
+    double d;
+    std::vector<FacePair> pairs;
+    std::vector<const Mesh*> meshes;
+    std::vector<int> topology_versions, nnodes, nfaces;
+    std::vector<Vec3> xs; // of meshes without an instance
+    std::vector<RigidInstance*> instances;
+    std::vector<Transformation> poses;
+    std::vector< std::vector<const Face*> > instance_faces;
+    bool valid (const std::vector<Mesh*> &meshes,
+                const std::vector<Mesh*> &obs_meshes, double d,
+                AccelCache &accel_cache) const;
+};
+
+// constraints are allocated in the arena
 std::vector<Constraint*> proximity_constraints
     (const std::vector<Mesh*> &meshes, const std::vector<Mesh*> &obs_meshes,
-     double friction, double obs_friction);
+     double friction, double obs_friction, ConstraintArena &arena,
+     AccelCache &accel_cache, ProximityCache &proximity_cache);
 
 #endif
@@ -41,6 +41,7 @@ using namespace std;
 
 static string outprefix;
 static fstream timingfile;
+static const bool verbose = false; // print solver statistics with each frame
 
 Simulation sim;
 int frame;
@@ -111,6 +112,26 @@ static void save_timings () {
     out << endl;
 }
 
+static void print_solver_stats () {
+    if (!verbose)
+        return;
+    for (int c = 0; c < sim.cloths.size(); c++) {
+        const TaucsSolver &taucs = sim.cloths[c].system.taucs;
+        const PcgSolver &pcg = sim.cloths[c].system.pcg;
+        if (pcg.nsolves)
+            printf("cloth %d: %d pcg solves, %.1f iterations on average, "
+                   "%d not converged\n", c, pcg.nsolves,
+                   (double)pcg.niters/pcg.nsolves, pcg.nfailures);
+        if (taucs.nsolves)
+            printf("cloth %d: %d taucs solves, %d symbolic factorizations "
+                   "skipped\n", c, taucs.nsolves,
+                   taucs.nsolves - taucs.nsymbolic);
+    }
+    if (sim.adaptive.enabled)
+        printf("%d adaptive steps, %d rolled back\n", sim.adaptive.nsteps,
+               sim.adaptive.nrollbacks);
+}
+
 void save (const Simulation &sim, int frame) {
     save(sim.cloth_meshes, frame, sim.non_rigid);
     if (!sim.non_rigid) {
@@ -121,6 +142,11 @@ void save (const Simulation &sim, int frame) {
 void sim_step(const int num_frames) {
     fps.tick();
     advance_step(sim);
+    for (int o = 0; o < sim.obstacles.size(); o++)
+        if (sim.obstacles[o].finished) {
+            cout << "Done." << endl;
+            exit(EXIT_SUCCESS);
+        }
 
     // double time;
     // int frame, step;
@@ -139,11 +165,13 @@ void sim_step(const int num_frames) {
             frame_steps = sim.init_frame_steps;
         if (sim.init_wait_frames <= 1 && sim.step > 0 && sim.step % frame_steps == 0) {
             save(sim, sim.frame);
+            print_solver_stats();
         }
     } else {
         if (sim.step % frame_steps == 0) {
             save(sim, sim.frame);
             save_timings();
+            print_solver_stats();
         }
     }
     fps.tock();
@@ -28,6 +28,7 @@
 
 #include "collisionutil.hpp"
 #include "geometry.hpp"
+#include "instance.hpp"
 #include "io.hpp"
 #include "magic.hpp"
 #include "optimization.hpp"
@@ -63,13 +64,13 @@ vector<Ixn> find_intersections (const vector<AccelStruct*> &accs,
 void solve_ixns (const vector<Ixn> &ixns);
 
 void separate (vector<Mesh*> &meshes, const vector<Mesh*> &old_meshes,
-               const vector<Mesh*> &obs_meshes) {
+               const vector<Mesh*> &obs_meshes, AccelCache &accel_cache) {
     ::meshes = &meshes;
     ::old_meshes = &old_meshes;
     ::obs_meshes = &obs_meshes;
     ::xold = node_positions(meshes);
-    vector<AccelStruct*> accs = create_accel_structs(meshes, false),
-                         obs_accs = create_accel_structs(obs_meshes, false);
+    vector<AccelStruct*> accs = accel_cache.get(meshes, false),
+                         obs_accs = accel_cache.get(obs_meshes, false);
     vector<Ixn> ixns;
     int iter;
     for (iter = 0; iter < max_iter; iter++) {
@@ -87,6 +88,9 @@ void separate (vector<Mesh*> &meshes, const vector<Mesh*> &old_meshes,
     }
     if (iter == max_iter) {
         cerr << "Post-remeshing separation failed to converge!" << endl;
+        for (int o = 0; o < obs_accs.size(); o++)
+            if (obs_accs[o]->instance)
+                obs_accs[o]->instance->update_all();
         debug_save_meshes(meshes, "meshes");
         debug_save_meshes(old_meshes, "oldmeshes");
         debug_save_meshes(obs_meshes, "obsmeshes");
@@ -96,8 +100,6 @@ void separate (vector<Mesh*> &meshes, const vector<Mesh*> &old_meshes,
         compute_ws_data(*meshes[m]);
         update_x0(*meshes[m]);
     }
-    destroy_accel_structs(accs);
-    destroy_accel_structs(obs_accs);
 }
 
 Vec3 pos (const Face *face, const Bary &b) {
@@ -145,7 +147,8 @@ vector<Ixn> find_intersections (const vector<AccelStruct*> &accs,
     }
     for (int t = 0; t < ::nthreads; t++)
         ::ixns[t].clear();
-    for_overlapping_faces(accs, obs_accs, ::thickness, find_face_intersection);
+    for_overlapping_faces(accs, obs_accs, ::thickness, find_face_intersection,
+                          true);
     vector<Ixn> ixns;
     for (int t = 0; t < ::nthreads; t++)
         append(ixns, ::ixns[t]);
@@ -27,9 +27,10 @@
 #ifndef SEPARATE_HPP
 #define SEPARATE_HPP
 
+#include "accelcache.hpp"
 #include "mesh.hpp"
 
 void separate (std::vector<Mesh*> &meshes, const std::vector<Mesh*> &old_meshes,
-               const std::vector<Mesh*> &obs_meshes);
+               const std::vector<Mesh*> &obs_meshes, AccelCache &accel_cache);
 
 #endif
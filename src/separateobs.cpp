@@ -136,7 +136,7 @@ vector<Ixn> find_intersections (const vector<AccelStruct*> &accs,
     }
     for (int t = 0; t < SO::nthreads; t++)
         SO::ixns[t].clear();
-    for_overlapping_faces(obs_accs, accs, 1e-3, find_face_intersection);
+    for_overlapping_faces(obs_accs, accs, 1e-3, find_face_intersection, true);
     vector<Ixn> ixns;
     for (int t = 0; t < SO::nthreads; t++)
         append(ixns, SO::ixns[t]);
@@ -56,7 +56,7 @@ void plasticity_step (Simulation &sim);
 void strainlimiting_step (Simulation &sim, const vector<Constraint*> &cons);
 void strainzeroing_step (Simulation &sim);
 void equilibration_step (Simulation &sim);
-void collision_step (Simulation &sim);
+int collision_step (Simulation &sim, bool exit_on_failure=true);
 void remeshing_step (Simulation &sim, bool initializing=false);
 
 void validate_handles (const Simulation &sim);
@@ -72,6 +72,8 @@ void prepare (Simulation &sim) {
     for (int o = 0; o < sim.obstacles.size(); o++) {
         sim.obstacle_meshes[o] = &sim.obstacles[o].get_mesh();
         update_x0(*sim.obstacle_meshes[o]);
+        sim.accel_structs.set_instance(*sim.obstacle_meshes[o],
+                                       &sim.obstacles[o].instance);
     }
 }
 
@@ -112,28 +114,197 @@ void validate_handles (const Simulation &sim) {
 }
 
 vector<Constraint*> get_constraints (Simulation &sim, bool include_proximity);
-void delete_constraints (const vector<Constraint*> &cons);
-void update_obstacles (Simulation &sim, bool update_positions=true);
+void update_obstacles (Simulation &sim, bool update_positions=true,
+                       int span=1);
 
 void advance_step (Simulation &sim);
 
 void advance_frame (Simulation &sim) {
-    for (int s = 0; s < sim.frame_steps; s++)
+    int end_step = sim.step + sim.frame_steps;
+    while (sim.step < end_step)
         advance_step(sim);
 }
 
-void advance_step (Simulation &sim) {
+// advances by span nominal steps; returns the number of collision response
+// iterations, or -1 if collision response failed
+static int take_step (Simulation &sim, int span, bool exit_on_failure) {
+    double step_time = sim.step_time;
+    sim.step_time *= span;
     sim.time += sim.step_time;
-    sim.step++;
+    sim.step += span;
     if (sim.non_rigid)
-        update_obstacles(sim, true);
+        update_obstacles(sim, true, span);
     else
-        update_obstacles(sim, false);
+        update_obstacles(sim, false, span);
     vector<Constraint*> cons = get_constraints(sim, true);
     physics_step(sim, cons);
     plasticity_step(sim);
     strainlimiting_step(sim, cons);
-    collision_step(sim);
+    int iter = collision_step(sim, exit_on_failure);
+    sim.step_time = step_time;
+    return iter;
+}
+
+// everything a step changes, short of remeshing
+struct StepState {
+    double time;
+    int step;
+    vector< vector<Vec3> > node_data; // x, x0, v, y, acceleration per node
+    vector<char> attached; // obstacles' instances, with their poses
+    vector<RigidInstance::Pose> poses;
+    vector< vector<Mat2x2> > S_plastic;
+    vector< vector<double> > face_damage;
+    vector< vector<Vec3> > edge_data; // theta_ideal, damage, reference_angle
+};
+
+static vector<Mesh*> stepped_meshes (const Simulation &sim) {
+    vector<Mesh*> meshes = sim.cloth_meshes;
+    append(meshes, sim.obstacle_meshes);
+    return meshes;
+}
+
+static void save_state (const Simulation &sim, StepState &state) {
+    state.time = sim.time;
+    state.step = sim.step;
+    int nobs = sim.obstacles.size();
+    state.attached.resize(nobs);
+    state.poses.resize(nobs);
+    for (int o = 0; o < nobs; o++) {
+        state.attached[o] = sim.obstacles[o].instance.attached;
+        state.poses[o] = sim.obstacles[o].instance.pose;
+    }
+    vector<Mesh*> meshes = stepped_meshes(sim);
+    state.node_data.resize(meshes.size());
+    for (int m = 0; m < meshes.size(); m++) {
+        const vector<Node*> &nodes = meshes[m]->nodes;
+        vector<Vec3> &data = state.node_data[m];
+        int o = m - sim.cloth_meshes.size();
+        if (o >= 0 && state.attached[o]) {
+            data.clear(); // the pose is enough
+            continue;
+        }
+        data.resize(5*nodes.size());
+        for (int n = 0; n < nodes.size(); n++) {
+            const Node *node = nodes[n];
+            data[5*n+0] = node->x;
+            data[5*n+1] = node->x0;
+            data[5*n+2] = node->v;
+            data[5*n+3] = node->y;
+            data[5*n+4] = node->acceleration;
+        }
+    }
+    int ncloths = sim.cloths.size();
+    state.S_plastic.resize(ncloths);
+    state.face_damage.resize(ncloths);
+    state.edge_data.resize(ncloths);
+    for (int c = 0; c < ncloths; c++) {
+        const Mesh &mesh = sim.cloths[c].mesh;
+        state.S_plastic[c].resize(mesh.faces.size());
+        state.face_damage[c].resize(mesh.faces.size());
+        for (int f = 0; f < mesh.faces.size(); f++) {
+            state.S_plastic[c][f] = mesh.faces[f]->S_plastic;
+            state.face_damage[c][f] = mesh.faces[f]->damage;
+        }
+        state.edge_data[c].resize(mesh.edges.size());
+        for (int e = 0; e < mesh.edges.size(); e++) {
+            const Edge *edge = mesh.edges[e];
+            state.edge_data[c][e] = Vec3(edge->theta_ideal, edge->damage,
+                                         edge->reference_angle);
+        }
+    }
+}
+
+static void restore_state (Simulation &sim, const StepState &state) {
+    sim.time = state.time;
+    sim.step = state.step;
+    for (int o = 0; o < sim.obstacles.size(); o++) {
+        RigidInstance &instance = sim.obstacles[o].instance;
+        if (state.attached[o] && !instance.base->nodes.empty())
+            instance.attach(*instance.base, *instance.mesh, state.poses[o]);
+        else if (instance.attached)
+            instance.detach();
+    }
+    vector<Mesh*> meshes = stepped_meshes(sim);
+    for (int m = 0; m < meshes.size(); m++) {
+        const vector<Node*> &nodes = meshes[m]->nodes;
+        const vector<Vec3> &data = state.node_data[m];
+        if (data.size() != 5*nodes.size())
+            continue; // obstacle was swapped out, nothing to restore
+        for (int n = 0; n < nodes.size(); n++) {
+            Node *node = nodes[n];
+            node->x = data[5*n+0];
+            node->x0 = data[5*n+1];
+            node->v = data[5*n+2];
+            node->y = data[5*n+3];
+            node->acceleration = data[5*n+4];
+        }
+        compute_ws_data(*meshes[m]);
+    }
+    for (int c = 0; c < sim.cloths.size(); c++) {
+        Mesh &mesh = sim.cloths[c].mesh;
+        for (int f = 0; f < mesh.faces.size(); f++) {
+            mesh.faces[f]->S_plastic = state.S_plastic[c][f];
+            mesh.faces[f]->damage = state.face_damage[c][f];
+        }
+        for (int e = 0; e < mesh.edges.size(); e++) {
+            Edge *edge = mesh.edges[e];
+            edge->theta_ideal = state.edge_data[c][e][0];
+            edge->damage = state.edge_data[c][e][1];
+            edge->reference_angle = state.edge_data[c][e][2];
+        }
+    }
+    sim.constraints.reset();
+}
+
+// largest displacement due to the velocity update of the last step
+static double velocity_update_displacement (const Simulation &sim,
+                                            double dt) {
+    double dx = 0;
+    for (int c = 0; c < sim.cloth_meshes.size(); c++) {
+        const Mesh &mesh = *sim.cloth_meshes[c];
+        for (int n = 0; n < mesh.nodes.size(); n++)
+            dx = max(dx, norm(mesh.nodes[n]->acceleration));
+    }
+    return dx*sq(dt);
+}
+
+// takes the largest step the controller allows, rolling back and retrying
+// with half the span on failure; returns the span taken
+static int adaptive_step (Simulation &sim) {
+    Simulation::Adaptive &adaptive = sim.adaptive;
+    int span = min(adaptive.span,
+                   sim.frame_steps - sim.step % sim.frame_steps);
+    StepState state;
+    while (true) {
+        if (span > 1)
+            save_state(sim, state);
+        int iter = take_step(sim, span, span == 1);
+        double dx = velocity_update_displacement(sim, span*sim.step_time);
+        if (span > 1 && (iter < 0 || dx > 2*adaptive.max_dx)) {
+            if (verbose)
+                cout << "rolling back step of span " << span << ": dx = "
+                     << dx << ", " << iter << " collision iterations" << endl;
+            restore_state(sim, state);
+            adaptive.nrollbacks++;
+            span /= 2;
+            continue;
+        }
+        adaptive.nsteps++;
+        if (dx > adaptive.max_dx || iter > adaptive.max_iter)
+            adaptive.span = max(span/2, 1);
+        else if (dx < adaptive.max_dx/2 && iter < adaptive.max_iter/2)
+            adaptive.span = min(max(2*span, adaptive.span),
+                                adaptive.max_span);
+        return span;
+    }
+}
+
+void advance_step (Simulation &sim) {
+    int span = 1;
+    if (sim.adaptive.enabled && !sim.init_frame_steps)
+        span = adaptive_step(sim);
+    else
+        take_step(sim, 1, true);
     if (sim.init_frame_steps) {
         if (sim.step == sim.init_frame_steps + 1) {
             sim.init_frame_steps = 0;
@@ -143,35 +314,33 @@ void advance_step (Simulation &sim) {
                 sim.frame++;
         }
     } else {
-        if ((sim.step - 1) % sim.frame_steps == 0) {
+        if ((sim.step - span) % sim.frame_steps == 0) {
             remeshing_step(sim);
             sim.init_wait_frames = max(0, sim.init_wait_frames - 1);
             if (!sim.init_wait_frames)
                 sim.frame++;
         }
     }
-    delete_constraints(cons);
+    sim.constraints.reset();
 }
 
 vector<Constraint*> get_constraints (Simulation &sim, bool include_proximity) {
     vector<Constraint*> cons;
     for (int h = 0; h < sim.handles.size(); h++)
-        append(cons, sim.handles[h]->get_constraints(sim.time));
+        append(cons, sim.handles[h]->get_constraints(sim.time,
+                                                     sim.constraints));
     if (include_proximity && sim.enabled[proximity]) {
         sim.timers[proximity].tick();
         append(cons, proximity_constraints(sim.cloth_meshes,
                                            sim.obstacle_meshes,
-                                           sim.friction, sim.obs_friction));
+                                           sim.friction, sim.obs_friction,
+                                           sim.constraints, sim.accel_structs,
+                                           sim.proximity_cache));
         sim.timers[proximity].tock();
     }
     return cons;
 }
 
-void delete_constraints (const vector<Constraint*> &cons) {
-    for (int c = 0; c < cons.size(); c++)
-        delete cons[c];
-}
-
 // Steps
 
 void update_velocities (vector<Mesh*> &meshes, vector<Vec3> &xold, double dt);
@@ -182,21 +351,29 @@ void physics_step (Simulation &sim, const vector<Constraint*> &cons) {
     if (!sim.enabled[physics])
         return;
     sim.timers[physics].tick();
-    for (int c = 0; c < sim.cloths.size(); c++) {
+    int ncloths = sim.cloths.size();
+    vector< vector<Vec3> > fext(ncloths);
+    vector< vector<Mat3x3> > Jext(ncloths);
+    for (int c = 0; c < ncloths; c++) {
         int nn = sim.cloths[c].mesh.nodes.size();
-        vector<Vec3> fext(nn, Vec3(0));
-        vector<Mat3x3> Jext(nn, Mat3x3(0));
-        add_external_forces(sim.cloths[c], sim.gravity, sim.wind, fext, Jext);
+        fext[c].assign(nn, Vec3(0));
+        Jext[c].assign(nn, Mat3x3(0));
+        add_external_forces(sim.cloths[c], sim.gravity, sim.wind, fext[c],
+                            Jext[c]);
         for (int m = 0; m < sim.morphs.size(); m++)
             if (sim.morphs[m].mesh == &sim.cloths[c].mesh)
                 add_morph_forces(sim.cloths[c], sim.morphs[m], sim.time,
-                                 sim.step_time, fext, Jext);
-        implicit_update(sim.cloths[c], fext, Jext, cons, sim.step_time, false);
+                                 sim.step_time, fext[c], Jext[c]);
     }
+    implicit_update(sim.cloths, fext, Jext, cons, sim.step_time, false);
     for (int c = 0; c < sim.cloth_meshes.size(); c++)
         step_mesh(*sim.cloth_meshes[c], sim.step_time);
-    for (int o = 0; o < sim.obstacle_meshes.size(); o++)
-        step_mesh(*sim.obstacle_meshes[o], sim.step_time);
+    for (int o = 0; o < sim.obstacles.size(); o++) {
+        if (sim.obstacles[o].instance.attached)
+            sim.obstacles[o].instance.step();
+        else
+            step_mesh(*sim.obstacle_meshes[o], sim.step_time);
+    }
     sim.timers[physics].tock();
 }
 
@@ -239,14 +416,14 @@ void equilibration_step (Simulation &sim) {
     }
     // swap(stiff, ::magic.handle_stiffness);
     sim.timers[remeshing].tock();
-    delete_constraints(cons);
     cons = get_constraints(sim, false);
     if (sim.enabled[collision]) {
         sim.timers[collision].tick();
-        collision_response(sim.cloth_meshes, cons, sim.obstacle_meshes);
+        collision_response(sim.cloth_meshes, cons, sim.obstacle_meshes,
+                           sim.accel_structs);
         sim.timers[collision].tock();
     }
-    delete_constraints(cons);
+    sim.constraints.reset();
 }
 
 void strainzeroing_step (Simulation &sim) {
@@ -254,28 +431,30 @@ void strainzeroing_step (Simulation &sim) {
     vector<Vec2> strain_limits(size<Face>(sim.cloth_meshes), Vec2(1,1));
     vector<Constraint*> cons =
         proximity_constraints(sim.cloth_meshes, sim.obstacle_meshes,
-                              sim.friction, sim.obs_friction);
+                              sim.friction, sim.obs_friction, sim.constraints,
+                              sim.accel_structs, sim.proximity_cache);
     strain_limiting(sim.cloth_meshes, strain_limits, cons);
-    delete_constraints(cons);
+    sim.constraints.reset();
     sim.timers[strainlimiting].tock();
     if (sim.enabled[collision]) {
         sim.timers[collision].tock();
         collision_response(sim.cloth_meshes, vector<Constraint*>(),
-                           sim.obstacle_meshes);
+                           sim.obstacle_meshes, sim.accel_structs);
         sim.timers[collision].tock();
     }
 }
 
-void collision_step (Simulation &sim) {
+int collision_step (Simulation &sim, bool exit_on_failure) {
     if (!sim.enabled[collision])
-        return;
+        return 0;
     sim.timers[collision].tick();
     vector<Vec3> xold = node_positions(sim.cloth_meshes);
     vector<Constraint*> cons = get_constraints(sim, false);
-    collision_response(sim.cloth_meshes, cons, sim.obstacle_meshes);
-    delete_constraints(cons);
+    int iter = collision_response(sim.cloth_meshes, cons, sim.obstacle_meshes,
+                                  sim.accel_structs, exit_on_failure);
     update_velocities(sim.cloth_meshes, xold, sim.step_time);
     sim.timers[collision].tock();
+    return iter;
 }
 
 void remeshing_step (Simulation &sim, bool initializing) {
@@ -300,14 +479,15 @@ void remeshing_step (Simulation &sim, bool initializing) {
     }
     // remesh
     sim.timers[remeshing].tick();
+    vector< vector<Plane> > planes;
+    if (!::magic.fixed_high_res_mesh)
+        planes = nearest_obstacle_planes(sim.cloth_meshes, sim.obstacle_meshes,
+                                         sim.accel_structs);
     for (int c = 0; c < sim.cloths.size(); c++) {
         if (::magic.fixed_high_res_mesh)
             static_remesh(sim.cloths[c]);
-        else {
-            vector<Plane> planes = nearest_obstacle_planes(sim.cloths[c].mesh,
-                                                           sim.obstacle_meshes);
-            dynamic_remesh(sim.cloths[c], planes, sim.enabled[plasticity]);
-        }
+        else
+            dynamic_remesh(sim.cloths[c], planes[c], sim.enabled[plasticity]);
     }
     sim.timers[remeshing].tock();
     // restore residuals
@@ -320,7 +500,8 @@ void remeshing_step (Simulation &sim, bool initializing) {
     // separate
     if (sim.enabled[separation]) {
         sim.timers[separation].tick();
-        separate(sim.cloth_meshes, old_meshes_p, sim.obstacle_meshes);
+        separate(sim.cloth_meshes, old_meshes_p, sim.obstacle_meshes,
+                 sim.accel_structs);
         sim.timers[separation].tock();
     }
     // apply pop filter
@@ -329,7 +510,6 @@ void remeshing_step (Simulation &sim, bool initializing) {
         vector<Constraint*> cons = get_constraints(sim, true);
         for (int c = 0; c < sim.cloths.size(); c++)
             apply_pop_filter(sim.cloths[c], cons);
-        delete_constraints(cons);
         sim.timers[popfilter].tock();
     }
     // delete old meshes
@@ -346,20 +526,24 @@ void update_velocities (vector<Mesh*> &meshes, vector<Vec3> &xold, double dt) {
     }
 }
 
-void update_obstacles (Simulation &sim, bool update_positions) {
+void update_obstacles (Simulation &sim, bool update_positions, int span) {
     double decay_time = 0.1, blend = 0.;
     
     if (sim.non_rigid) {
         int frame_steps = sim.frame_steps;
         if (sim.init_frame_steps)
             frame_steps = sim.init_frame_steps;
-        blend = 1. / frame_steps;
+        blend = (double)span / frame_steps;
     } else {
         blend = sim.step_time/decay_time;
         blend = blend/(1 + blend);
     }
 
+    // rigid obstacles are moved by their pose alone once attached
+    bool instanced = !sim.non_rigid && !update_positions;
     for (int o = 0; o < sim.obstacles.size(); o++) {
+        if (instanced && sim.obstacles[o].move(sim.time, sim.step_time))
+            continue;
         if (sim.non_rigid) {
             if (sim.init_wait_frames) {
                 if (sim.step <= sim.init_frame_steps) {
@@ -383,6 +567,9 @@ void update_obstacles (Simulation &sim, bool update_positions) {
                 node->x = node->x0;
             }
         }
+        if (instanced)
+            sim.obstacles[o].attach(sim.time, sim.step_time,
+                                    1e-3*::magic.repulsion_thickness);
     }
 }
 
@@ -27,11 +27,13 @@
 #ifndef SIMULATION_HPP
 #define SIMULATION_HPP
 
+#include "accelcache.hpp"
 #include "cloth.hpp"
 #include "constraint.hpp"
 #include "handle.hpp"
 #include "morph.hpp"
 #include "obstacle.hpp"
+#include "proximity.hpp"
 #include "spline.hpp"
 #include "timer.hpp"
 #include <string>
@@ -57,6 +59,19 @@ struct Simulation {
     int frame_steps;
     double frame_time, step_time;
     double end_time, end_frame;
+    // adaptive stepping: each step spans a whole number of nominal steps
+    // (frame_time/frame_steps), never crossing a frame boundary. The span is
+    // halved when the velocity update moves nodes by more than max_dx or
+    // collision response needs more than max_iter iterations, and doubled up
+    // to max_span when both are comfortably below. Steps that overshoot
+    // badly or fail collision response are rolled back and retried.
+    struct Adaptive {
+        bool enabled;
+        int max_span, max_iter;
+        double max_dx;
+        int span; // of the next step
+        int nsteps, nrollbacks; // statistics
+    } adaptive;
     std::vector<Motion> motions;
     std::vector<Handle*> handles;
     std::vector<Obstacle> obstacles;
@@ -68,6 +83,12 @@ struct Simulation {
           PopFilter, Plasticity, nModules};
     bool enabled[nModules];
     Timer timers[nModules];
+    // constraints of the current step, released at the end of it
+    ConstraintArena constraints;
+    // collision and proximity queries' bounding volume hierarchies
+    AccelCache accel_structs;
+    // face pairs near enough for proximity constraints
+    ProximityCache proximity_cache;
     // handy pointers
     std::vector<Mesh*> cloth_meshes, obstacle_meshes;
 };
@@ -154,11 +154,11 @@ void SLOpt::con_grad (const double *x, int j, double factor,
                       double *grad) const {
     if (j < cons.size()) {
         MeshGrad mgrad = cons[j]->gradient();
-        for (MeshGrad::iterator it=mgrad.begin(); it!=mgrad.end(); it++) {
-            int n = get_index(it->first, meshes);
+        for (int k = 0; k < mgrad.n; k++) {
+            int n = get_index(mgrad.nodes[k], meshes);
             if (n == -1)
                 continue;
-            const Vec3 &g = it->second;
+            Vec3 g = mgrad[k];
             for (int i = 0; i < 3; i++)
                 grad[n*3+i] += factor*g[i];
         }
@@ -39,6 +39,17 @@ int taucs_linsolve (taucs_ccs_matrix* A, // input matrix
                     void* B, // right-hand sides
                     char* options[], // options (what to do and how)
                     void* arguments[]); // option arguments
+void taucs_ccs_order (taucs_ccs_matrix* matrix, int** perm, int** invperm,
+                      char* which);
+taucs_ccs_matrix* taucs_ccs_permute_symmetrically (taucs_ccs_matrix* A,
+                                                   int* perm, int* invperm);
+void* taucs_ccs_factor_llt_symbolic (taucs_ccs_matrix* A);
+int taucs_ccs_factor_llt_numeric (taucs_ccs_matrix* A, void* L);
+int taucs_supernodal_solve_llt (void* L, void* x, void* b);
+void taucs_supernodal_factor_free (void* L);
+void taucs_supernodal_factor_free_numeric (void* L);
+void taucs_vec_permute (int n, int flags, void* v, void* pv, int p[]);
+void taucs_vec_ipermute (int n, int flags, void* v, void* pv, int p[]);
 }
 
 ostream &operator<< (ostream &out, taucs_ccs_matrix *A) {
@@ -124,6 +135,52 @@ template <int m> taucs_ccs_matrix *sparse_to_taucs (const SpMat< Mat<m,m> > &As)
     return At;
 }
 
+// writes the lower triangle of As into At, which must have room for it;
+// the row indices are only written if structure is true
+template <int m> void bsr_to_taucs (const BsrMat< Mat<m,m> > &As,
+                                    taucs_ccs_matrix *At, bool structure) {
+    int n = As.n;
+    int pos = 0;
+    for (int i = 0; i < n; i++) {
+        for (int k = 0; k < m; k++) {
+            if (structure)
+                At->colptr[i*m+k] = pos;
+            for (int jj = As.rowptr[i]; jj < As.rowptr[i+1]; jj++) {
+                int j = As.colind[jj];
+                if (j < i)
+                    continue;
+                const Mat<m,m> &Aij = As.entries[jj];
+                for (int l = (i==j) ? k : 0; l < m; l++) {
+                    if (structure)
+                        At->rowind[pos] = j*m+l;
+                    At->values.d[pos] = Aij(k,l);
+                    pos++;
+                }
+            }
+        }
+    }
+    if (structure)
+        At->colptr[n*m] = pos;
+}
+
+template <int m> taucs_ccs_matrix *sparse_to_taucs (const BsrMat< Mat<m,m> > &As) {
+    // assumption: A is square and symmetric
+    int n = As.n;
+    int nnz = 0;
+    for (int i = 0; i < n; i++) {
+        for (int jj = As.rowptr[i]; jj < As.rowptr[i+1]; jj++) {
+            int j = As.colind[jj];
+            if (j < i)
+                continue;
+            nnz += (j==i) ? m*(m+1)/2 : m*m;
+        }
+    }
+    taucs_ccs_matrix *At = taucs_ccs_create
+        (n*m,n*m, nnz, TAUCS_DOUBLE | TAUCS_SYMMETRIC | TAUCS_LOWER);
+    bsr_to_taucs(As, At, true);
+    return At;
+}
+
 vector<double> taucs_linear_solve (const SpMat<double> &A, const vector<double> &b) {
     // taucs_logfile("stdout");
     taucs_ccs_matrix *Ataucs = sparse_to_taucs(A);
@@ -153,5 +210,79 @@ template <int m> vector< Vec<m> > taucs_linear_solve
     return x;
 }
 
+TaucsSolver::TaucsSolver ():
+    nsolves(0), nsymbolic(0), A(NULL), perm(NULL), invperm(NULL), L(NULL) {}
+
+TaucsSolver::TaucsSolver (const TaucsSolver &solver):
+    nsolves(0), nsymbolic(0), A(NULL), perm(NULL), invperm(NULL), L(NULL) {}
+
+TaucsSolver &TaucsSolver::operator= (const TaucsSolver &solver) {
+    clear();
+    return *this;
+}
+
+TaucsSolver::~TaucsSolver () {
+    clear();
+}
+
+void TaucsSolver::clear () {
+    if (L)
+        taucs_supernodal_factor_free(L);
+    if (A)
+        taucs_ccs_free((taucs_ccs_matrix*)A);
+    free(perm); // allocated by the library with plain malloc
+    free(invperm);
+    L = A = NULL;
+    perm = invperm = NULL;
+    rowptr.clear();
+    colind.clear();
+}
+
+template <int m> vector< Vec<m> > TaucsSolver::solve
+    (const BsrMat< Mat<m,m> > &As, const vector< Vec<m> > &b) {
+    nsolves++;
+    if (As.rowptr != rowptr || As.colind != colind) {
+        // new pattern: redo ordering and symbolic factorization
+        clear();
+        rowptr = As.rowptr;
+        colind = As.colind;
+        A = sparse_to_taucs(As);
+        // the symbolic phase uses static scratch inside TAUCS, so it can't
+        // run concurrently for different systems; the numeric one can
+#pragma omp critical (taucs_symbolic)
+        {
+            taucs_ccs_order((taucs_ccs_matrix*)A, &perm, &invperm,
+                            (char*)"genmmd");
+            taucs_ccs_matrix *PAPT = taucs_ccs_permute_symmetrically
+                ((taucs_ccs_matrix*)A, perm, invperm);
+            L = taucs_ccs_factor_llt_symbolic(PAPT);
+            taucs_ccs_free(PAPT);
+        }
+        if (!perm || !L) {
+            cerr << "Error: TAUCS symbolic factorization failed" << endl;
+            exit(EXIT_FAILURE);
+        }
+        nsymbolic++;
+    } else
+        bsr_to_taucs(As, (taucs_ccs_matrix*)A, false);
+    taucs_ccs_matrix *PAPT = taucs_ccs_permute_symmetrically
+        ((taucs_ccs_matrix*)A, perm, invperm);
+    taucs_supernodal_factor_free_numeric(L);
+    int retval = taucs_ccs_factor_llt_numeric(PAPT, L);
+    taucs_ccs_free(PAPT);
+    if (retval != TAUCS_SUCCESS) {
+        cerr << "Error: TAUCS failed with return value " << retval << endl;
+        exit(EXIT_FAILURE);
+    }
+    int n = b.size()*m;
+    vector< Vec<m> > x(b.size()), Pb(b.size()), Px(b.size());
+    taucs_vec_permute(n, TAUCS_DOUBLE, (double*)&b[0], &Pb[0], perm);
+    taucs_supernodal_solve_llt(L, &Px[0], &Pb[0]);
+    taucs_vec_ipermute(n, TAUCS_DOUBLE, &Px[0], &x[0], perm);
+    return x;
+}
+
 template vector<Vec3> taucs_linear_solve (const SpMat<Mat3x3> &A,
                                           const vector<Vec3> &b);
+template vector<Vec3> TaucsSolver::solve (const BsrMat<Mat3x3> &A,
+                                          const vector<Vec3> &b);
@@ -27,6 +27,7 @@
 #ifndef TAUCS_HPP
 #define TAUCS_HPP
 
+#include "bsr.hpp"
 #include "sparse.hpp"
 #include "vectors.hpp"
 
@@ -36,4 +37,26 @@ std::vector<double> taucs_linear_solve (const SpMat<double> &A,
 template <int m> std::vector< Vec<m> > taucs_linear_solve
     (const SpMat< Mat<m,m> > &A, const std::vector< Vec<m> > &b);
 
+// Sparse Cholesky solver for a sequence of systems with the same sparsity
+// pattern. The fill-reducing ordering and the symbolic factorization are
+// kept between solves and only redone when the pattern changes; otherwise
+// just the numeric factorization is recomputed.
+struct TaucsSolver {
+    int nsolves, nsymbolic; // statistics
+    TaucsSolver ();
+    // copies start from scratch rather than share the factorization
+    TaucsSolver (const TaucsSolver &solver);
+    TaucsSolver &operator= (const TaucsSolver &solver);
+    ~TaucsSolver ();
+    template <int m> std::vector< Vec<m> > solve
+        (const BsrMat< Mat<m,m> > &A, const std::vector< Vec<m> > &b);
+    void clear ();
+private:
+    // block pattern the ordering and symbolic factorization were made for
+    std::vector<int> rowptr, colind;
+    void *A; // taucs_ccs_matrix with the above pattern
+    int *perm, *invperm;
+    void *L; // supernodal factor
+};
+
 #endif